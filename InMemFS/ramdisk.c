@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 34
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -9,36 +9,80 @@
 #define _XOPEN_SOURCE 700
 #endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <libgen.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 
+#define TABLE_MIN 8 // buckets of a directory's first name table
+#define FILE_PAGE 4096 // file data is stored in pages of this many bytes
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0) // renameat2() flag, from <linux/fs.h>
+#endif
+
 // file struct
 typedef struct FileInfo FileInfo;
 struct FileInfo {
-	char *name;
-	char *data;
-	unsigned int size; // in bytes
+	char *name; // last component of the path, the full path is the chain of parents' names
+	char **pages; // FILE_PAGE bytes each, NULL for a page never written (reads as zeros)
+	size_t pagesLen; // entries in pages, room for at least size bytes
+	off_t size; // in bytes, of the whole subtree for a directory, changed atomically
 	bool isFile;
+	pthread_rwlock_t lock; // pages and a file's size
+	uint64_t refs; // the kernel's lookups of us plus our open handles, we are freed once unlinked and unreferenced
 
 	// pointers for directory structure
-	FileInfo *parent;
-	FileInfo *children; // first child
+	FileInfo *parent; // NULL once unlinked
+	FileInfo *children; // first child, the oldest
+	FileInfo *lastChild;
 	FileInfo *next; // next sibling
+	FileInfo *prev; // previous sibling
+	off_t dirOffset; // where we are in the parent's listing, readdir resumes after it
+	off_t lastOffset; // dirOffset of the newest child, 2 (after . and ..) if none
+
+	// children indexed by name
+	FileInfo **table; // hash buckets, NULL until the first child is added
+	unsigned int tableSize; // a power of 2
+	unsigned int count; // number of children
+	unsigned int hash; // of our own name
+	FileInfo *hashNext; // next in the parent's bucket
 };
 
 // global variables
-static int disk_size;
-static FileInfo *root = NULL;
+static off_t disk_size;
+static FileInfo *root = NULL; // its size is how much of the disk is in use
+
+// Operations that only look names up, and write files, share this lock and
+// run in parallel, each file's data being guarded by its own lock. Creating,
+// removing and renaming entries takes it exclusively.
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// -o options of our own, the rest go to FUSE
+typedef struct {
+	double entry_timeout; // seconds the kernel may cache a name, or that it does not exist
+	double attr_timeout; // seconds the kernel may cache attributes
+} Options;
+
+// Nothing changes the tree behind the kernel's back, so it can cache for long
+static Options options = { 60.0, 60.0 };
+
+static const struct fuse_opt option_spec[] = {
+	{ "entry_timeout=%lf", offsetof(Options, entry_timeout), 0 },
+	{ "attr_timeout=%lf", offsetof(Options, attr_timeout), 0 },
+	FUSE_OPT_END
+};
 
 // utilities
 static void* smalloc(size_t size) { // safe malloc
@@ -50,15 +94,54 @@ static void* smalloc(size_t size) { // safe malloc
 	return ptr;
 }
 
+static void* scalloc(size_t nmemb, size_t size) { // safe calloc
+	void *ptr = calloc(nmemb, size);
+	if(ptr == NULL) {
+		fprintf(stderr, "Failed to allocate memory with calloc()!\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static unsigned int hash_name(const char *name, size_t len) { // FNV-1a
+	unsigned int hash = 2166136261u;
+	for(size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 // BEGIN file functions
-static void File_update_size(FileInfo *file, int delta);
+static bool File_update_size(FileInfo *file, off_t delta);
+
+// the inode number the kernel knows us by is our address, except for the root
+static fuse_ino_t File_ino(FileInfo *fi) {
+	return fi == root ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) fi;
+}
+
+static FileInfo* File_get(fuse_ino_t ino) {
+	return ino == FUSE_ROOT_ID ? root : (FileInfo*) (uintptr_t) ino;
+}
+
+static bool File_unlinked(FileInfo *fi) {
+	return fi->parent == NULL && fi != root;
+}
+
+static void File_set_name(FileInfo *fi, const char *name) {
+	size_t len = strlen(name);
+	fi->name = smalloc(len + 1);
+	memcpy(fi->name, name, len + 1);
+	fi->hash = hash_name(name, len);
+}
 
 static FileInfo* File_create(const char *name, bool isFile) {
 	FileInfo *fi = (FileInfo*) smalloc(sizeof(FileInfo));
 	memset(fi, 0, sizeof(FileInfo));
-	fi->name = smalloc(strlen(name) + 1);
-	strcpy(fi->name, name);
+	File_set_name(fi, name);
 	fi->isFile = isFile;
+	fi->lastOffset = 2;
+	pthread_rwlock_init(&fi->lock, NULL);
 	return fi;
 }
 
@@ -66,353 +149,629 @@ static void File_destroy(FileInfo *fi, bool destroySiblings) {
 	if(fi == NULL) return;
 	if(destroySiblings) File_destroy(fi->next, destroySiblings);
 	File_destroy(fi->children, true);
+	free(fi->table);
 	free(fi->name);
-	if(fi->data != NULL) {
-		free(fi->data);
+	if(fi->pages != NULL) {
+		for(size_t i = 0; i < fi->pagesLen; i++) free(fi->pages[i]);
+		free(fi->pages);
 		File_update_size(fi->parent, -fi->size);
 	}
+	pthread_rwlock_destroy(&fi->lock);
 	free(fi);
 }
 
-static FileInfo* File_find(const char *path, FileInfo *fi) {
-	// base cases
-	if(fi == NULL) return NULL;
-	if(!strcmp(path, fi->name)) return fi;
+// child of dir named name[0..len)
+static FileInfo* File_lookup(FileInfo *dir, const char *name, size_t len) {
+	if(dir->table == NULL) return NULL;
+	unsigned int hash = hash_name(name, len);
+	FileInfo *child = dir->table[hash & (dir->tableSize - 1)];
+	for(; child != NULL; child = child->hashNext) {
+		if(child->hash != hash) continue;
+		if(!strncmp(child->name, name, len) && child->name[len] == '\0') return child;
+	}
+	return NULL;
+}
 
-	// recursive find
-	if(strstr(path, fi->name) == path) {
-		FileInfo *res = File_find(path, fi->children);
-		if(res != NULL) return res;
+// child of dir named name, NULL if there is none or dir is a file
+static FileInfo* File_find(FileInfo *dir, const char *name) {
+	return dir->isFile ? NULL : File_lookup(dir, name, strlen(name));
+}
+
+static void File_table_grow(FileInfo *dir) {
+	unsigned int size = dir->tableSize ? dir->tableSize * 2 : TABLE_MIN;
+	FileInfo **table = scalloc(size, sizeof(FileInfo*));
+	for(unsigned int i = 0; i < dir->tableSize; i++) {
+		FileInfo *child = dir->table[i];
+		while(child != NULL) {
+			FileInfo *next = child->hashNext;
+			FileInfo **bucket = &table[child->hash & (size - 1)];
+			child->hashNext = *bucket;
+			*bucket = child;
+			child = next;
+		}
 	}
-	return File_find(path, fi->next);
+	free(dir->table);
+	dir->table = table;
+	dir->tableSize = size;
+}
+
+static void File_table_insert(FileInfo *dir, FileInfo *child) {
+	if(dir->count >= dir->tableSize) File_table_grow(dir); // at most one child per bucket on average
+	FileInfo **bucket = &dir->table[child->hash & (dir->tableSize - 1)];
+	child->hashNext = *bucket;
+	*bucket = child;
+	dir->count++;
 }
 
-static FileInfo* File_find_parent(const char *path) {
-	char tmp[strlen(path) + 1];
-	strcpy(tmp, path);
-	return File_find(dirname(tmp), root);
+static void File_table_remove(FileInfo *dir, FileInfo *child) {
+	FileInfo **bucket = &dir->table[child->hash & (dir->tableSize - 1)];
+	while(*bucket != child) bucket = &(*bucket)->hashNext;
+	*bucket = child->hashNext;
+	child->hashNext = NULL;
+	dir->count--;
 }
 
 static void File_stat(FileInfo *fi, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = File_ino(fi);
 	stbuf->st_mode = fi->isFile ? S_IFREG | 0644 : S_IFDIR | 0755;
-	stbuf->st_nlink = fi->isFile ? 1 : 2;
+	stbuf->st_nlink = File_unlinked(fi) ? 0 : fi->isFile ? 1 : 2;
 	stbuf->st_uid = getuid();
 	stbuf->st_gid = getgid();
-	stbuf->st_size = fi->size;
+	stbuf->st_size = __atomic_load_n(&fi->size, __ATOMIC_RELAXED);
 	stbuf->st_blocks = 0;
 	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
 }
 
-static void File_remove_child(FileInfo *parent, FileInfo *child, bool destroy) {
-	FileInfo *prevChild = NULL;
-	FileInfo *currChild = parent->children;
-	if(currChild == child) parent->children = child->next;
-	else {
-		while(currChild->next != NULL) {
-			prevChild = currChild;
-			currChild = currChild->next;
-			if(currChild == child) {
-				prevChild->next = child->next;
-				break;
-			}
-		}
-	}
-	if(destroy) File_destroy(child, false);
-	else {
-		child->parent = child->next = NULL;
-	}
+// fill e for a reply that hands the kernel fi, File_ref counts the reference
+static void File_entry(FileInfo *fi, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = File_ino(fi);
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
+	File_stat(fi, &e->attr);
+}
+
+// references are counted with tree_lock held, for reading at least
+static void File_ref(FileInfo *fi) {
+	__atomic_add_fetch(&fi->refs, 1, __ATOMIC_RELAXED);
 }
 
+static void File_unref(FileInfo *fi, uint64_t refs) {
+	if(__atomic_sub_fetch(&fi->refs, refs, __ATOMIC_ACQ_REL) == 0 && File_unlinked(fi))
+		File_destroy(fi, false);
+}
+
+// an open file's handle is the FileInfo itself, so its I/O needs no lookup
+static void File_open(FileInfo *fi, struct fuse_file_info *ffi) {
+	File_ref(fi);
+	ffi->fh = (uint64_t) (uintptr_t) fi;
+	ffi->keep_cache = 1; // what the kernel cached from an earlier open is still valid
+}
+
+static FileInfo* File_handle(struct fuse_file_info *ffi) {
+	return (FileInfo*) (uintptr_t) ffi->fh;
+}
+
+static void File_remove_child(FileInfo *parent, FileInfo *child) {
+	File_table_remove(parent, child);
+	if(child->prev != NULL) child->prev->next = child->next;
+	else parent->children = child->next;
+	if(child->next != NULL) child->next->prev = child->prev;
+	else parent->lastChild = child->prev;
+	child->parent = child->next = child->prev = NULL;
+}
+
+// the children's names are relative to us, so they stay as they are
 static void File_rename(FileInfo *file, const char *newname) {
 	char *oldname = file->name;
-	size_t oldlen = strlen(oldname);
-	size_t newlen = strlen(newname);
-	int delta = newlen - oldlen;
-
-	// Copy new name
-	file->name = smalloc(newlen + 1);
-	strcpy(file->name, newname);
-
-	// Update children name
-	FileInfo *child = file->children;
-	while(child != NULL) {
-		char child_newname[strlen(child->name) + delta + 1];
-		memcpy(child_newname, newname, newlen);
-		strcpy(child_newname + newlen, child->name + oldlen);
-		File_rename(child, child_newname);
-		child = child->next;
-	}
-
+	File_set_name(file, newname);
 	free(oldname);
 }
 
+static bool File_is_ancestor(FileInfo *ancestor, FileInfo *fi) {
+	for(; fi != NULL; fi = fi->parent) {
+		if(fi == ancestor) return true;
+	}
+	return false;
+}
+
+// appended, so offsets of a listing in progress stay valid
 static void File_add_child(FileInfo *parent, FileInfo *child) {
 	child->parent = parent;
-	child->next = parent->children;
-	parent->children = child;
+	child->next = NULL;
+	child->prev = parent->lastChild;
+	if(child->prev != NULL) child->prev->next = child;
+	else parent->children = child;
+	parent->lastChild = child;
+	child->dirOffset = ++parent->lastOffset;
+	File_table_insert(parent, child);
+}
+
+static size_t pages_for(off_t size) {
+	return (size + FILE_PAGE - 1) / FILE_PAGE;
+}
+
+// make room in the page table for size bytes, the new pages are holes
+static void File_reserve(FileInfo *file, off_t size) {
+	size_t need = pages_for(size);
+	if(need <= file->pagesLen) return;
+	size_t len = file->pagesLen ? file->pagesLen : 1;
+	while(len < need) len *= 2; // appends copy each pointer O(1) times on average
+	file->pages = realloc(file->pages, len * sizeof(char*));
+	if(file->pages == NULL) {
+		fprintf(stderr, "Failed to allocate memory with realloc()!\n");
+		exit(1);
+	}
+	memset(file->pages + file->pagesLen, 0, (len - file->pagesLen) * sizeof(char*));
+	file->pagesLen = len;
 }
 
-static int File_resize(FileInfo *file, size_t size) {
+// drop the data past size, so it reads as zeros should the file grow again
+static void File_trim(FileInfo *file, off_t size) {
+	size_t keep = pages_for(size);
+	for(size_t i = keep; i < pages_for(file->size); i++) {
+		free(file->pages[i]);
+		file->pages[i] = NULL;
+	}
+	size_t tail = size % FILE_PAGE;
+	if(tail != 0 && file->pages[keep - 1] != NULL)
+		memset(file->pages[keep - 1] + tail, 0, FILE_PAGE - tail);
+	if(size == 0) {
+		free(file->pages);
+		file->pages = NULL;
+		file->pagesLen = 0;
+	}
+}
+
+static int File_resize(FileInfo *file, off_t size) {
 	if(file == NULL || !file->isFile) return -EINVAL;
 	if(file->size == size) return 0;
 	
-	int delta = size - file->size;
-	if(root->size + delta > disk_size)
+	if(!File_update_size(file->parent, size - file->size))
 		return -ENOSPC;	
-	File_update_size(file->parent, delta);
 
-	file->size = size;
-	if(size == 0) {
-		free(file->data);
-		file->data = NULL;
-	} else {
-		file->data = realloc(file->data, file->size);
-		if(file->data == NULL) {
-			fprintf(stderr, "Failed to allocate memory with realloc()!\n");
-			exit(1);
-		}
-	}
+	if(size < file->size) File_trim(file, size);
+	else File_reserve(file, size);
+	__atomic_store_n(&file->size, size, __ATOMIC_RELAXED);
 	return 0;
 }
 
-static void File_update_size(FileInfo *file, int delta) {
-	while(file != NULL) {
-		file->size += delta;
-		file = file->parent;
+// what holes read as
+static const char zero_page[FILE_PAGE];
+
+// number of pieces File_map splits size bytes at offset into
+static size_t pieces_for(size_t size, off_t offset) {
+	return (offset % FILE_PAGE + size + FILE_PAGE - 1) / FILE_PAGE;
+}
+
+// Point iov at the size bytes at offset, one piece per page, so they can be
+// copied to or from the pages directly. The file must hold them. Holes are
+// the zero page, unless alloc, which gives them pages of their own.
+static void File_map(FileInfo *file, size_t size, off_t offset, bool alloc, struct iovec *iov) {
+	while(size > 0) {
+		size_t start = offset % FILE_PAGE;
+		size_t n = FILE_PAGE - start < size ? FILE_PAGE - start : size;
+		char **page = &file->pages[offset / FILE_PAGE];
+		if(*page == NULL && alloc) *page = scalloc(1, FILE_PAGE);
+		iov->iov_base = (*page != NULL ? *page : (char*) zero_page) + start;
+		iov->iov_len = n;
+		iov++;
+		offset += n;
+		size -= n;
 	}
 }
-// END file functions
 
-static int ramdisk_getattr(const char *path, struct stat *stbuf)
-{
-	FileInfo *fi = File_find(path, root);
-	if(fi != NULL) {
-		File_stat(fi, stbuf);
-		return 0;
-	} else {
-		return -ENOENT;
+// add delta to the sizes of file and its ancestors below the root
+static void File_add_size(FileInfo *file, off_t delta) {
+	for(; file != NULL && file != root; file = file->parent)
+		__atomic_add_fetch(&file->size, delta, __ATOMIC_RELAXED);
+}
+
+// Add delta to the sizes of file and its ancestors. Fails, changing nothing,
+// if the disk has no room for delta more bytes. Concurrent writers to
+// different files share the ancestors, hence the atomics.
+static bool File_update_size(FileInfo *file, off_t delta) {
+	off_t used = __atomic_add_fetch(&root->size, delta, __ATOMIC_RELAXED);
+	if(delta > 0 && used > disk_size) {
+		__atomic_sub_fetch(&root->size, delta, __ATOMIC_RELAXED);
+		return false;
 	}
+	File_add_size(file, delta);
+	return true;
 }
 
-static int ramdisk_access(const char *path, int mask)
-{
-	FileInfo *fi = File_find(path, root);
-	if(fi == NULL) return -ENOENT;
-	else return 0;
+// Take fi out of the tree. Its data still counts as used until it is freed,
+// which waits for the kernel to forget it and for its last handle to close.
+static void File_unlink(FileInfo *fi) {
+	File_add_size(fi->parent, -fi->size);
+	File_remove_child(fi->parent, fi);
+	if(__atomic_load_n(&fi->refs, __ATOMIC_RELAXED) == 0) File_destroy(fi, false);
 }
 
-static int ramdisk_readlink(const char *path, char *buf, size_t size)
-{
-	fprintf(stderr, "ramdisk_readlink is not implemented!\n");
-	return -EPERM;
+// how many of size bytes at offset can be read, file->lock held for reading
+static ssize_t File_readable(FileInfo *file, size_t size, off_t offset) {
+	if(offset < 0) return -EINVAL;
+	if(offset >= file->size) return 0;
+	if((off_t) size > file->size - offset) size = file->size - offset;
+	return size;
 }
 
+// grow the file if need be to write size bytes at offset, file->lock held for writing
+static int File_writable(FileInfo *file, size_t size, off_t offset) {
+	if(offset < 0) return -EINVAL;
+	if(offset + (off_t) size > file->size) return File_resize(file, offset + size);
+	return 0;
+}
 
-static int ramdisk_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
-{
-	struct stat stbuf;
-	FileInfo *finf = File_find(path, root);
-	if(finf == NULL) return -ENOENT;
-	else if(finf->isFile) {
-		File_stat(finf, &stbuf);
-		char tmp[strlen(finf->name) + 1];
-		strcpy(tmp, finf->name);
-  		filler (buf, basename(tmp), &stbuf, 0);
-	} else {
-		filler (buf, ".", NULL, 0);
-	  	filler (buf, "..", NULL, 0);
-	  	FileInfo *child = finf->children;
-	  	while(child != NULL) {
-	  		File_stat(child, &stbuf);
-			char tmp[strlen(child->name) + 1];
-			strcpy(tmp, child->name);
-	  		filler (buf, basename(tmp), &stbuf, 0);
-	  		child = child->next;
-	  	}
+// why renaming fromfile to the entry tofile (NULL if none) in parentfile is not allowed, 0 if it is
+static int File_rename_check(FileInfo *fromfile, FileInfo *tofile, FileInfo *parentfile) {
+	if(parentfile->isFile) return -ENOTDIR; // destination's parent is not a folder
+	if(fromfile == NULL || File_unlinked(parentfile)) return -ENOENT; // origin or destination's parent folder does not exist
+	if(File_is_ancestor(fromfile, parentfile)) return -EINVAL; // can't move to a sub directory of itself
+	if(tofile != NULL) { // target exists
+		if(!tofile->isFile) { // target is a directory
+			if(tofile->children != NULL) return -ENOTEMPTY; // can't override a non-empty folder
+			if(fromfile->isFile) return -EISDIR; // origin is a file
+		} else { // target is a file
+			if(!fromfile->isFile) return -ENOTDIR;
+		}
 	}
 	return 0;
 }
+// END file functions
 
-static int ramdisk_mkentry(const char *path, bool isFile) {
-	if(File_find(path, root) != NULL) return -EEXIST;
-	FileInfo *fi = File_find_parent(path);
-	if(fi == NULL || fi->isFile) {
-		return fi == NULL ? -ENOENT : -ENOTDIR;
-	} else {
-		File_add_child(fi, File_create(path, isFile));
-		return 0;
+static void ramdisk_init(void *userdata, struct fuse_conn_info *conn)
+{
+	// let the kernel gather writes in its page cache and write them back in big chunks
+	if(conn->capable & FUSE_CAP_WRITEBACK_CACHE) conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	// and hand us written data in a pipe, that write_buf reads into the pages
+	if(conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+	// only writes through the kernel change the data, and our timestamps are
+	// always the current time, so they must not make it drop its cache
+	conn->want &= ~FUSE_CAP_AUTO_INVAL_DATA;
+}
+
+static void ramdisk_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	pthread_rwlock_rdlock(&tree_lock);
+	FileInfo *fi = File_find(File_get(parent), name);
+	if(fi != NULL) {
+		File_entry(fi, &e);
+		File_ref(fi);
+	}
+	pthread_rwlock_unlock(&tree_lock);
+	if(fi == NULL) { // no inode, the kernel caches that the name does not exist
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = options.entry_timeout;
 	}
+	fuse_reply_entry(req, &e);
 }
 
-static int ramdisk_mknod(const char *path, mode_t mode, dev_t rdev)
+static void ramdisk_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-	return ramdisk_mkentry(path, true);
+	pthread_rwlock_rdlock(&tree_lock);
+	File_unref(File_get(ino), nlookup);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_none(req);
 }
 
-static int ramdisk_mkdir(const char *path, mode_t mode)
+static void ramdisk_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-	return ramdisk_mkentry(path, false);
+	pthread_rwlock_rdlock(&tree_lock);
+	for(size_t i = 0; i < count; i++)
+		File_unref(File_get(forgets[i].ino), forgets[i].nlookup);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_none(req);
 }
 
-static int ramdisk_unlink(const char *path)
+static void ramdisk_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	FileInfo *fi = File_find(path, root);
-	if(fi == NULL) return -ENOENT;
-	if(!fi->isFile) return -EISDIR;
-	File_remove_child(fi->parent, fi, true);
-	return 0;
+	struct stat stbuf;
+	pthread_rwlock_rdlock(&tree_lock);
+	File_stat(File_get(ino), &stbuf);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_attr(req, &stbuf, options.attr_timeout);
 }
 
-static int ramdisk_rmdir(const char *path)
+static void ramdisk_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int to_set, struct fuse_file_info *fi)
 {
-	FileInfo *fi = File_find(path, root);
-	if(fi == NULL) return -ENOENT;
-	if(fi == root) return -EBUSY;
-	if(fi->isFile) return -ENOTDIR;
-	if(fi->children != NULL) return -ENOTEMPTY;
-	File_remove_child(fi->parent, fi, true);
-	return 0;
+	if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fprintf(stderr, "ramdisk_setattr only changes sizes and times!\n");
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	// times are not stored, they always read as the current time
+	int res = 0;
+	struct stat stbuf;
+	pthread_rwlock_rdlock(&tree_lock);
+	FileInfo *file = File_get(ino);
+	if(to_set & FUSE_SET_ATTR_SIZE) {
+		if(!file->isFile) res = -EISDIR;
+		else if(attr->st_size < 0) res = -EINVAL;
+		else {
+			pthread_rwlock_wrlock(&file->lock);
+			res = File_resize(file, attr->st_size); // the new bytes are holes, they read as zeros
+			pthread_rwlock_unlock(&file->lock);
+		}
+	}
+	if(res == 0) File_stat(file, &stbuf);
+	pthread_rwlock_unlock(&tree_lock);
+	if(res == 0) fuse_reply_attr(req, &stbuf, options.attr_timeout);
+	else fuse_reply_err(req, -res);
 }
 
-static int ramdisk_symlink(const char *from, const char *to)
+static void ramdisk_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	fprintf(stderr, "ramdisk_symlink is not implemented!\n");
-	return -EPERM;
+	fuse_reply_err(req, 0);
 }
 
-static int ramdisk_rename(const char *from, const char *to)
+static void ramdisk_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-	if(!strcmp(from, to)) return 0; // nothing to do
-	if(strstr(to, from) == to) return -EINVAL; // can't move to a sub directory of itself
+	fprintf(stderr, "ramdisk_readlink is not implemented!\n");
+	fuse_reply_err(req, EPERM);
+}
+
+// add the entry name for fi, which readdirplus hands to the kernel, to the
+// listing in buf. Returns false, adding nothing, if it does not fit.
+static bool File_dirent(fuse_req_t req, char *buf, size_t size, size_t *used,
+		const char *name, FileInfo *fi, off_t next, bool plus) {
+	size_t len = plus ? fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0)
+		: fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	if(len > size - *used) return false;
+	if(plus) {
+		struct fuse_entry_param e;
+		File_entry(fi, &e);
+		fuse_add_direntry_plus(req, buf + *used, size - *used, name, &e, next);
+		if(strcmp(name, ".") && strcmp(name, "..")) File_ref(fi); // the kernel keeps no reference to these
+	} else {
+		struct stat stbuf;
+		File_stat(fi, &stbuf);
+		fuse_add_direntry(req, buf + *used, size - *used, name, &stbuf, next);
+	}
+	*used += len;
+	return true;
+}
 
-	FileInfo *fromfile = File_find(from, root);
-	FileInfo *tofile = File_find(to, root);
-	FileInfo *parentfile = File_find_parent(to);
+// . and .. are at offsets 1 and 2, the children follow in the order they were added
+static void ramdisk_listdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus)
+{
+	char *buf = smalloc(size);
+	size_t used = 0;
+	bool full = false;
+	pthread_rwlock_rdlock(&tree_lock);
+	FileInfo *dir = File_get(ino);
+	if(offset < 1) full = !File_dirent(req, buf, size, &used, ".", dir, 1, plus);
+	if(!full && offset < 2) full = !File_dirent(req, buf, size, &used, "..", dir->parent != NULL ? dir->parent : dir, 2, plus);
+	FileInfo *child = dir->children;
+	while(child != NULL && child->dirOffset <= offset) child = child->next;
+	for(; !full && child != NULL; child = child->next)
+		full = !File_dirent(req, buf, size, &used, child->name, child, child->dirOffset, plus);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void ramdisk_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	ramdisk_listdir(req, ino, size, offset, false);
+}
 
-	if(fromfile == root || tofile == root) return -EBUSY; // neither old or new can point to the root dir
-	if(fromfile == NULL || parentfile == NULL) return -ENOENT; // origin or destination's parent folder does not exist
-	if(parentfile->isFile) return -ENOTDIR; // destination's parent is not a folder
-	if(tofile != NULL) { // target exists
-		if(!tofile->isFile) { // target is a directory
-			if(tofile->children != NULL) return -ENOTEMPTY; // can't override a non-empty folder
-			if(fromfile->isFile) return -EISDIR; // origin is a file
-		} else { // target is a file
-			if(!fromfile->isFile) return -ENOTDIR;
-		}
+// readdir with each entry's attributes, saving the kernel a lookup for each
+static void ramdisk_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	ramdisk_listdir(req, ino, size, offset, true);
+}
+
+// make the entry, and open it too if ffi is not NULL
+static void ramdisk_mkentry(fuse_req_t req, fuse_ino_t parent, const char *name, bool isFile,
+			struct fuse_file_info *ffi) {
+	int res = 0;
+	struct fuse_entry_param e;
+	pthread_rwlock_wrlock(&tree_lock);
+	FileInfo *dir = File_get(parent);
+	if(dir->isFile) res = -ENOTDIR;
+	else if(File_unlinked(dir)) res = -ENOENT;
+	else if(File_find(dir, name) != NULL) res = -EEXIST;
+	else {
+		FileInfo *fi = File_create(name, isFile);
+		File_add_child(dir, fi);
+		File_entry(fi, &e);
+		File_ref(fi);
+		if(ffi != NULL) File_open(fi, ffi);
 	}
+	pthread_rwlock_unlock(&tree_lock);
+	if(res != 0) fuse_reply_err(req, -res);
+	else if(ffi != NULL) fuse_reply_create(req, &e, ffi);
+	else fuse_reply_entry(req, &e);
+}
 
-	// Done with error checking, now move it
-	if(tofile != NULL) File_remove_child(parentfile, tofile, true);
-	File_remove_child(fromfile->parent, fromfile, false);
-	File_rename(fromfile, to);
-	File_add_child(parentfile, fromfile);
+static void ramdisk_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, dev_t rdev)
+{
+	ramdisk_mkentry(req, parent, name, true, NULL);
+}
 
-	return 0;
+static void ramdisk_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	ramdisk_mkentry(req, parent, name, false, NULL);
 }
 
-static int ramdisk_link(const char *from, const char *to)
+// mknod and open in one go
+static void ramdisk_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		       mode_t mode, struct fuse_file_info *fi)
 {
-	fprintf(stderr, "ramdisk_link is not implemented!\n");
-	return -EPERM;
+	ramdisk_mkentry(req, parent, name, true, fi);
 }
 
-static int ramdisk_chmod(const char *path, mode_t mode)
+static void ramdisk_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	fprintf(stderr, "ramdisk_chmod is not implemented!\n");
-	return -EPERM;
+	int res = 0;
+	pthread_rwlock_wrlock(&tree_lock);
+	FileInfo *fi = File_find(File_get(parent), name);
+	if(fi == NULL) res = -ENOENT;
+	else if(!fi->isFile) res = -EISDIR;
+	else File_unlink(fi);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_err(req, -res);
 }
 
-static int ramdisk_chown(const char *path, uid_t uid, gid_t gid)
+static void ramdisk_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	fprintf(stderr, "ramdisk_chown is not implemented!\n");
-	return -EPERM;
+	int res = 0;
+	pthread_rwlock_wrlock(&tree_lock);
+	FileInfo *fi = File_find(File_get(parent), name);
+	if(fi == NULL) res = -ENOENT;
+	else if(fi->isFile) res = -ENOTDIR;
+	else if(fi->children != NULL) res = -ENOTEMPTY;
+	else File_unlink(fi);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_err(req, -res);
+}
+
+static void ramdisk_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+			const char *name)
+{
+	fprintf(stderr, "ramdisk_symlink is not implemented!\n");
+	fuse_reply_err(req, EPERM);
 }
 
-static int ramdisk_truncate(const char *path, off_t size)
+static void ramdisk_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		       fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
-	if(size < 0) return -EINVAL;
-	FileInfo *file = File_find(path, root);
-	if(file == NULL) return -ENOENT;
-	if(!file->isFile) return -EISDIR;
-
-	int oldsize = file->size;
-	int res = File_resize(file, size);
-	if(res == 0 && size > oldsize) { // success, memset new bytes to 0
-		memset(file->data + oldsize, 0, size - oldsize);
+	if(flags & ~RENAME_NOREPLACE) { // RENAME_EXCHANGE, or a flag we don't know
+		fuse_reply_err(req, EINVAL);
+		return;
 	}
-	return res;
+
+	pthread_rwlock_wrlock(&tree_lock);
+	FileInfo *parentfile = File_get(newparent);
+	FileInfo *fromfile = File_find(File_get(parent), name);
+	FileInfo *tofile = File_find(parentfile, newname);
+	int res = File_rename_check(fromfile, tofile, parentfile);
+	if(res == 0 && tofile != NULL && (flags & RENAME_NOREPLACE)) res = -EEXIST;
+	if(res == 0 && fromfile != tofile) { // move it, along with the size it adds to its ancestors
+		if(tofile != NULL) File_unlink(tofile);
+		File_add_size(fromfile->parent, -fromfile->size);
+		File_remove_child(fromfile->parent, fromfile);
+		File_rename(fromfile, newname);
+		File_add_child(parentfile, fromfile);
+		File_add_size(parentfile, fromfile->size);
+	}
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_err(req, -res);
 }
 
-#ifdef HAVE_UTIMENSAT
-static int ramdisk_utimens(const char *path, const struct timespec ts[2])
+static void ramdisk_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		     const char *newname)
 {
-	fprintf(stderr, "ramdisk_utimens is not implemented!\n");
-	return -EPERM;
+	fprintf(stderr, "ramdisk_link is not implemented!\n");
+	fuse_reply_err(req, EPERM);
 }
-#endif
 
-static int ramdisk_open(const char *path, struct fuse_file_info *fi)
+static void ramdisk_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	FileInfo *finf = File_find_parent(path);
-	if(finf == NULL || finf->isFile) return -ENOENT;
-	else return 0;
+	FileInfo *file = File_get(ino);
+	if(!file->isFile) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	pthread_rwlock_rdlock(&tree_lock);
+	File_open(file, fi);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_open(req, fi);
 }
 
-static int ramdisk_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+// the last release of an unlinked file frees it, unless the kernel still knows it
+static void ramdisk_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	FileInfo *file = File_find(path, root);
-	if(file == NULL) return -ENOENT;
-	if(!file->isFile) return -EISDIR;
-
-	// reading
-	int max = file->size - offset;
-	if(max < 0) return -EINVAL;
-	if(size > max) size = max;
-	if(size > 0) memcpy(buf, file->data + offset, size);
-	return size;
+	pthread_rwlock_rdlock(&tree_lock);
+	File_unref(File_handle(fi), 1);
+	pthread_rwlock_unlock(&tree_lock);
+	fuse_reply_err(req, 0);
 }
 
-static int ramdisk_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+// The reply points at the pages, which the kernel copies straight out of.
+// Only the file's own lock, a read touches nothing else, and it is held
+// until the reply is sent so the pages stay as they are.
+static void ramdisk_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		     struct fuse_file_info *fi)
 {
-	FileInfo *file = File_find(path, root);
-	if(file == NULL) return -ENOENT;
-	if(!file->isFile) return -EINVAL;
-
-	// check if additional space is needed
-	int additionalBytes = offset + size - file->size;
-	if(additionalBytes > 0) {
-		int res = File_resize(file, file->size + additionalBytes);
-		if(res != 0) return res;
+	FileInfo *file = File_handle(fi);
+	pthread_rwlock_rdlock(&file->lock);
+	ssize_t res = File_readable(file, size, offset);
+	if(res > 0) {
+		size_t count = pieces_for(res, offset);
+		struct iovec *iov = smalloc(count * sizeof(struct iovec));
+		File_map(file, res, offset, false, iov);
+		fuse_reply_iov(req, iov, count);
+		free(iov);
 	}
+	pthread_rwlock_unlock(&file->lock);
+	if(res == 0) fuse_reply_buf(req, NULL, 0);
+	else if(res < 0) fuse_reply_err(req, -res);
+}
 
-	// do the writing
-	memcpy(file->data + offset, buf, size);
-	return size;
+// The data goes straight into the pages, from the request buffer or, when
+// the kernel splices requests, from the pipe it left them in.
+static void ramdisk_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(in_buf);
+	pthread_rwlock_rdlock(&tree_lock); // growing the file changes its ancestors' sizes
+	FileInfo *file = File_handle(fi);
+	pthread_rwlock_wrlock(&file->lock);
+	ssize_t res = File_writable(file, size, offset);
+	if(res == 0 && size > 0) {
+		size_t count = pieces_for(size, offset);
+		struct iovec *iov = smalloc(count * sizeof(struct iovec));
+		struct fuse_bufvec *pages = smalloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+		File_map(file, size, offset, true, iov);
+		memset(pages, 0, sizeof(struct fuse_bufvec));
+		pages->count = count;
+		for(size_t i = 0; i < count; i++)
+			pages->buf[i] = (struct fuse_buf) { .size = iov[i].iov_len, .mem = iov[i].iov_base, .fd = -1 };
+		res = fuse_buf_copy(pages, in_buf, 0);
+		free(pages);
+		free(iov);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	pthread_rwlock_unlock(&tree_lock);
+	if(res >= 0) fuse_reply_write(req, res);
+	else fuse_reply_err(req, -res);
 }
 
-static int ramdisk_statfs(const char *path, struct statvfs *stbuf)
+static void ramdisk_statfs(fuse_req_t req, fuse_ino_t ino)
 {
 	fprintf(stderr, "ramdisk_statfs is not implemented!\n");
-	return -EPERM;
+	fuse_reply_err(req, EPERM);
 }
 
 #ifdef HAVE_POSIX_FALLOCATE
-static int ramdisk_fallocate(const char *path, int mode,
+static void ramdisk_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 			off_t offset, off_t length, struct fuse_file_info *fi)
 {
 	fprintf(stderr, "ramdisk_fallocate is not implemented!\n");
-	return -EPERM;
+	fuse_reply_err(req, EPERM);
 }
 #endif
 
-static struct fuse_operations ramdisk_oper = {
+static struct fuse_lowlevel_ops ramdisk_oper = {
+	.init		= ramdisk_init,
+	.lookup		= ramdisk_lookup,
+	.forget		= ramdisk_forget,
+	.forget_multi	= ramdisk_forget_multi,
 	.getattr	= ramdisk_getattr,
+	.setattr	= ramdisk_setattr,
 	.access		= ramdisk_access,
 	.readlink	= ramdisk_readlink,
 	.readdir	= ramdisk_readdir,
+	.readdirplus	= ramdisk_readdirplus,
 	.mknod		= ramdisk_mknod,
 	.mkdir		= ramdisk_mkdir,
 	.symlink	= ramdisk_symlink,
@@ -420,15 +779,11 @@ static struct fuse_operations ramdisk_oper = {
 	.rmdir		= ramdisk_rmdir,
 	.rename		= ramdisk_rename,
 	.link		= ramdisk_link,
-	.chmod		= ramdisk_chmod,
-	.chown		= ramdisk_chown,
-	.truncate	= ramdisk_truncate,
-#ifdef HAVE_UTIMENSAT
-	.utimens	= ramdisk_utimens,
-#endif
+	.create		= ramdisk_create,
 	.open		= ramdisk_open,
+	.release	= ramdisk_release,
 	.read		= ramdisk_read,
-	.write		= ramdisk_write,
+	.write_buf	= ramdisk_write_buf,
 	.statfs		= ramdisk_statfs,
 #ifdef HAVE_POSIX_FALLOCATE
 	.fallocate	= ramdisk_fallocate,
@@ -437,8 +792,8 @@ static struct fuse_operations ramdisk_oper = {
 
 int main(int argc, char *argv[])
 {
-	if(argc != 3) {
-		printf("Usage: %s <mount-path> <size-in-MB>\n", argv[0]);
+	if(argc < 3) {
+		printf("Usage: %s [-o entry_timeout=T,attr_timeout=T] <mount-path> <size-in-MB>\n", argv[0]);
 		return 1;
 	}
 
@@ -450,14 +805,46 @@ int main(int argc, char *argv[])
 	}
 	disk_size = disk_size * 1024 * 1024;
 
+	// the remaining arguments are for us and FUSE
+	struct fuse_args args = FUSE_ARGS_INIT(argc-1, argv);
+	struct fuse_cmdline_opts opts;
+	if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1 || fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if(opts.show_help || opts.mountpoint == NULL) {
+		printf("Usage: %s [-o entry_timeout=T,attr_timeout=T] <mount-path> <size-in-MB>\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		free(opts.mountpoint);
+		fuse_opt_free_args(&args);
+		return opts.show_help ? 0 : 1;
+	}
+
 	// setup root folder
 	root = File_create("/", false);
 
 	// mount with fuse
 	umask(0);
-	int res = fuse_main(argc-1, argv, &ramdisk_oper, NULL);
+	int res = 1;
+	struct fuse_session *se = fuse_session_new(&args, &ramdisk_oper, sizeof(ramdisk_oper), NULL);
+	if(se != NULL) {
+		if(fuse_set_signal_handlers(se) == 0) {
+			if(fuse_session_mount(se, opts.mountpoint) == 0) {
+				fuse_daemonize(opts.foreground);
+				if(opts.singlethread) res = fuse_session_loop(se);
+				else {
+					struct fuse_loop_config config = { .clone_fd = opts.clone_fd, .max_idle_threads = opts.max_idle_threads };
+					res = fuse_session_loop_mt(se, &config);
+				}
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
 
 	// cleanup
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
 	File_destroy(root, false);
-	return res;
+	return res != 0;
 }
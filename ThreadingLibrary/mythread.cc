@@ -1,74 +1,916 @@
-#include "mythread.h"
-#include <ucontext.h>
+#include "mythread_impl.h"
 #include <stdlib.h>
 #include <stdio.h>
-#include <queue>
-#include <set>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
 
-#define THREAD_STACK 1024*8
+// Default stack size, the guard page comes on top of this. Only the pages a
+// thread touches become resident, so a bigger stack costs address space and
+// not memory, while 8 KB could be overflowed by a single printf.
+#define THREAD_STACK 1024*64
+#define STACK_CACHE 32 // free stacks a worker keeps per class
+#define ALT_STACK 1024*64
+#define TCB_SLAB 64 // control blocks allocated at once when the pool runs dry
+#define TCB_CACHE 64 // free control blocks a worker keeps
+#define MAX_WORKERS 256
+#define IDLE_SPINS 1000
+#define POLL_INTERVAL 64 // switches between polls for I/O while busy
+#define HANDOFF_STREAK 16 // run_next threads run in a row before the ready queue gets a turn
+#define MLFQ_SLICE 1000000 // ns a thread runs at a level before it sinks, unless there is a quantum
+#define MLFQ_BOOST 100000000 // ns between lifting all threads back to their priority
+#define ANY_LEVEL (MYTHREAD_PRIORITIES - 1)
 
-typedef struct {
-	ucontext_t context;
-	void *parent;
-	std::set<void*> children;
-	std::set<void*> blocked_by;
-} _MyThread;
+// ****** CONTEXT SWITCH BACKENDS ******
+// CONTEXT=asm in the Makefile defines MYTHREAD_CONTEXT_ASM and links
+// mythread_switch.S, which only saves callee-saved registers and the stack
+// pointer. Otherwise fall back to ucontext, whose swapcontext also does a
+// rt_sigprocmask system call on every switch.
+#ifdef MYTHREAD_CONTEXT_ASM
+
+extern "C" void _mythread_switch(void **save_sp, void *new_sp);
+
+// Lay out a stack as if entry had been switched away from right at its start.
+// entry must never return.
+static void _ctxMake(_MyContext *ctx, void *stack, size_t size, void(*entry)(void))
+{
+	void **top = (void**)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+#if defined(__x86_64__)
+	top[-1] = 0; // fake return address of entry, keeps the ABI stack alignment
+	top[-2] = (void*)entry;
+	for(int i = 3; i <= 8; i++) top[-i] = 0; // rbp rbx r12-r15
+	uint32_t *fpu = (uint32_t*)&top[-9];
+	fpu[0] = 0x1F80; // default mxcsr
+	fpu[1] = 0x037F; // default x87 control word
+	ctx->sp = &top[-9];
+#elif defined(__aarch64__)
+	void **frame = top - 20;
+	for(int i = 0; i < 20; i++) frame[i] = 0; // x19-x29 and d8-d15
+	frame[11] = (void*)entry; // x30
+	ctx->sp = frame;
+#endif
+}
+
+static inline void _ctxSwitch(_MyContext *from, _MyContext *to)
+{
+	_mythread_switch(&from->sp, to->sp);
+}
+
+static inline void _ctxJump(_MyContext *to)
+{
+	void *discard;
+	_mythread_switch(&discard, to->sp);
+}
+
+#else
+
+static void _ctxMake(_MyContext *ctx, void *stack, size_t size, void(*entry)(void))
+{
+	getcontext(ctx);
+	ctx->uc_link = 0;
+	ctx->uc_stack.ss_sp = stack;
+	ctx->uc_stack.ss_size = size;
+	ctx->uc_stack.ss_flags = 0;
+	makecontext(ctx, entry, 0);
+}
+
+static inline void _ctxSwitch(_MyContext *from, _MyContext *to)
+{
+	swapcontext(from, to);
+}
+
+static inline void _ctxJump(_MyContext *to)
+{
+	setcontext(to);
+}
+
+#endif
+
+
+_MyWorker *workers = 0;
+int nworkers = 0;
+static __thread _MyWorker *tls_worker = 0;
 
+// threads that are running or sitting in a ready queue
+// once this drops to 0 nothing can ever become ready again
+std::atomic<int> nrunnable{0};
+
+// threads blocked on I/O or timers, only done once this and nrunnable are both 0
+// (MyThreadExternalHold counts as one too)
+std::atomic<int> npolled{0};
+
+// threads made ready from outside the workers, newest first, see _inject
+std::atomic<_MyThread*> injected{0};
+
+// between MyThreadInit starting the first thread and its scheduler loop returning
+std::atomic<bool> running{false};
+
+// one idle worker at a time polls for I/O and timers, the others sleep on idle_cond
+std::atomic<bool> polling{false};
+std::atomic<bool> poll_blocked{false};
+std::atomic<uint64_t> poll_deadline{0};
+
+// idle workers sleep here
+std::atomic<int> nsleeping{0};
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+// A MyThread may resume on a different kernel thread than the one it was
+// suspended on, so the compiler must not cache the TLS address across a switch.
+__attribute__((noinline)) _MyWorker *_worker()
+{
+	asm volatile("" ::: "memory");
+	return tls_worker;
+}
+
+// Raise the current thread's preempt_off. A preemption between reading the
+// worker and its current thread could move us to another worker and have us
+// raise some other thread's, so the preemption handler leaves code in this
+// section alone (see _inNoPreempt).
+__attribute__((noinline, section("mythread_nopreempt"))) _MyThread *_preemptOff()
+{
+	asm volatile("" ::: "memory");
+	_MyWorker *w = tls_worker;
+	_MyThread *t = w? w->current : 0;
+	if(t) t->preempt_off++;
+	return t;
+}
+
+static bool _anyReady()
+{
+	for(int i = 0; i < nworkers; i++)
+	{
+		if(workers[i].nready.load() > 0 || workers[i].run_next.load()) return true;
+	}
+	return injected.load() != 0;
+}
+
+// ****** SCHEDULING POLICIES ******
+// A policy picks the ready queue level a thread goes to; the worker always
+// runs the front of its most urgent non-empty level, found with one
+// count-trailing-zeros on the bitmap of non-empty levels.
 typedef struct {
-	int value;
-	std::queue<_MyThread*> block_queue;
-} _MySem;
+	// level to queue t at, must only read t
+	int (*level)(_MyThread *t);
+	// t is switched out after running for ran ns, 0 if the policy does not care
+	void (*charge)(_MyThread *t, uint64_t ran, uint64_t now);
+} _MyPolicy;
 
-ucontext_t main_context; // the context outside mythread library
-_MyThread *current_thread = 0;
-std::queue<_MyThread*> ready_queue;
+static int _fifoLevel(_MyThread *)
+{
+	return 0;
+}
 
-// dummy context to handle thread switching
-// primary purpose is to cleanup the exited thread's stack
-ucontext_t dummy_context;
-char dummy_stack[THREAD_STACK];
-void dummy_func(void)
+static int _priorityLevel(_MyThread *t)
 {
-	while(true)
+	return t->priority;
+}
+
+// MLFQ: a thread starts at its priority and sinks a level whenever it has
+// run for a slice there, counting across yields, so yielding just before the
+// slice is up does not keep it on top. Every MLFQ_BOOST all threads rise
+// back to their priority, so the ones at the bottom cannot starve.
+static std::atomic<unsigned int> mlfq_epoch{0};
+
+static int _mlfqLevel(_MyThread *t)
+{
+	return t->epoch == mlfq_epoch.load(std::memory_order_relaxed)? t->level : t->priority;
+}
+
+static void _mlfqCharge(_MyThread *t, uint64_t ran, uint64_t now)
+{
+	unsigned int epoch = now / MLFQ_BOOST;
+	if(mlfq_epoch.load(std::memory_order_relaxed) != epoch) mlfq_epoch.store(epoch, std::memory_order_relaxed);
+	if(t->epoch != epoch)
+	{
+		t->epoch = epoch;
+		t->level = t->priority;
+		t->used = 0;
+	}
+	t->used += ran;
+	if(t->used >= (preempt_quantum? preempt_quantum : MLFQ_SLICE))
+	{
+		t->used = 0;
+		if(t->level < MYTHREAD_PRIORITIES - 1) t->level++;
+	}
+}
+
+// indexed by MYTHREAD_POLICY_*
+static const _MyPolicy policies[] = {
+	{ _priorityLevel, 0 },
+	{ _fifoLevel, 0 },
+	{ _mlfqLevel, _mlfqCharge },
+};
+static const _MyPolicy *policy = &policies[MYTHREAD_POLICY_PRIORITY];
+
+// Pop the most urgent thread at level max_level or better, w->ready_lock held.
+// The owner takes the front of a level, thieves take the back.
+static _MyThread *_popReady(_MyWorker *w, int max_level, bool back)
+{
+	uint32_t levels = w->ready_levels.load(std::memory_order_relaxed);
+	if(!levels) return 0;
+	int level = __builtin_ctz(levels);
+	if(level > max_level) return 0;
+
+	_MyQueue *q = &w->ready_queue[level];
+	_MyThread *t = back? _qPopBack(q) : _qPopFront(q);
+	if(!q->head) w->ready_levels.store(levels & ~(1u << level), std::memory_order_relaxed);
+	w->nready.fetch_sub(1, std::memory_order_relaxed);
+	return t;
+}
+
+bool _urgentReady(_MyWorker *w, _MyThread *t)
+{
+	uint32_t levels = w->ready_levels.load(std::memory_order_relaxed);
+	return levels && __builtin_ctz(levels) < policy->level(t);
+}
+
+// Charge the current thread for its time on the CPU, if the policy keeps track
+static void _charge(_MyWorker *w)
+{
+	if(!policy->charge) return;
+	uint64_t now = _now();
+	if(w->current) policy->charge(w->current, now - w->dispatched, now);
+	w->dispatched = now;
+}
+
+// Get an idle worker to look for work, or all of them
+static void _kickIdle(bool all)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	bool sleeping = nsleeping.load() > 0;
+	if(sleeping)
+	{
+		pthread_mutex_lock(&idle_lock);
+		if(all) pthread_cond_broadcast(&idle_cond);
+		else pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+	if((all || !sleeping) && poll_blocked.load())
+	{ // nobody else is idle, get the poller back to work
+		_ioKick();
+	}
+}
+
+// Put n threads of one level, linked through next/prev from head to tail, at
+// the end of their level in w's ready queue and kick idle workers if there are any
+static void _pushReadyChain(_MyWorker *w, _MyThread *head, _MyThread *tail, int n)
+{
+	int level = policy->level(head);
+	_MyQueue *q = &w->ready_queue[level];
+	_lock(&w->ready_lock);
+	head->prev = q->tail;
+	if(q->tail) q->tail->next = head;
+	else q->head = head;
+	q->tail = tail;
+	w->ready_levels.store(w->ready_levels.load(std::memory_order_relaxed) | 1u << level, std::memory_order_relaxed);
+	w->nready.fetch_add(n, std::memory_order_relaxed);
+	_unlock(&w->ready_lock);
+	_kickIdle(n > 1); // enough for everyone to steal from
+}
+
+// Put a thread at the end of its level in w's ready queue
+static void _pushReady(_MyWorker *w, _MyThread *t)
+{
+	t->next = t->prev = 0;
+	_pushReadyChain(w, t, t, 1);
+}
+
+// Non-blocking I/O poll, unless another worker is already polling
+static void _pollNow()
+{
+	if(!polling.exchange(true))
 	{
-		// free resources
-		free(current_thread->context.uc_stack.ss_sp);
-		delete current_thread;
+		_ioPoll(0);
+		polling.store(false);
+	}
+}
+
+static bool _done()
+{
+	return nrunnable.load() == 0 && npolled.load() == 0;
+}
 
-		// simply exit if ready queue is empty
-		if(ready_queue.empty())
+// Hand t to the workers from a kernel thread that is not one of them. The
+// queue is a stack pushed with one CAS, linked through t->next, that the
+// next worker to look for a thread empties in one exchange.
+static void _inject(_MyThread *t)
+{
+	_MyThread *head = injected.load(std::memory_order_relaxed);
+	do t->next = head;
+	while(!injected.compare_exchange_weak(head, t, std::memory_order_release, std::memory_order_relaxed));
+	_kickIdle(false);
+}
+
+// Move the injected threads to w's ready queue, oldest first
+static void _injectDrain(_MyWorker *w)
+{
+	_MyThread *t = injected.exchange(0, std::memory_order_acquire);
+	_MyThread *oldest = 0;
+	while(t)
+	{
+		_MyThread *next = t->next;
+		t->next = oldest;
+		oldest = t;
+		t = next;
+	}
+	while(oldest)
+	{
+		_MyThread *next = oldest->next;
+		_pushReady(w, oldest);
+		oldest = next;
+	}
+}
+
+// Make a blocked (or newly created) thread runnable
+void _wake(_MyThread *t)
+{
+	TRACE(_traceWake(t));
+	nrunnable.fetch_add(1);
+	_MyWorker *w = _worker();
+	if(w) _pushReady(w, t);
+	else _inject(t);
+}
+
+void _wakeNext(_MyThread *t)
+{
+	_MyWorker *w = _worker();
+	TRACE(_traceWake(t));
+	nrunnable.fetch_add(1);
+	_MyThread *old = w->run_next.exchange(t);
+	if(old) _pushReady(w, old); // only the latest handoff jumps the queue
+}
+
+// Take w's run_next thread if it is at max_level or better
+static _MyThread *_takeNext(_MyWorker *w, int max_level)
+{
+	_MyThread *t = w->run_next.load(std::memory_order_relaxed);
+	if(!t || policy->level(t) > max_level) return 0;
+	t = w->run_next.exchange(0);
+	if(t && policy->level(t) > max_level)
+	{ // replaced meanwhile by a less urgent one
+		_pushReady(w, t);
+		t = 0;
+	}
+	return t;
+}
+
+static _MyThread *_steal(_MyWorker *w, int max_level)
+{
+	int start = rand_r(&w->seed) % nworkers;
+	for(int i = 0; i < nworkers; i++)
+	{
+		_MyWorker *victim = &workers[(start + i) % nworkers];
+		if(victim == w || victim->nready.load(std::memory_order_relaxed) == 0) continue;
+
+		_lock(&victim->ready_lock);
+		_MyThread *t = _popReady(victim, max_level, true);
+		_unlock(&victim->ready_lock);
+		if(t) return t;
+	}
+	for(int i = 0; i < nworkers; i++)
+	{ // a handoff the victim has not got round to
+		_MyWorker *victim = &workers[(start + i) % nworkers];
+		_MyThread *t = victim == w? 0 : _takeNext(victim, max_level);
+		if(t) return t;
+	}
+	return 0;
+}
+
+// Get the next thread to run at max_level or better: a handoff, then our
+// own queue, otherwise steal one
+static _MyThread *_nextReady(_MyWorker *w, int max_level)
+{
+	if(injected.load(std::memory_order_relaxed)) _injectDrain(w);
+
+	// two threads handing values back and forth must not starve the queue
+	bool queued = w->nready.load(std::memory_order_relaxed) > 0;
+	_MyThread *t = w->handoffs < HANDOFF_STREAK || !queued? _takeNext(w, max_level) : 0;
+	if(t)
+	{
+		w->handoffs++;
+		return t;
+	}
+	w->handoffs = 0;
+	if(queued)
+	{
+		_lock(&w->ready_lock);
+		t = _popReady(w, max_level, false);
+		_unlock(&w->ready_lock);
+	}
+	if(!t) t = _takeNext(w, max_level);
+	if(!t && nworkers > 1) t = _steal(w, max_level);
+	return t;
+}
+
+// ****** STACK POOL ******
+// Stacks are mmap'd with a PROT_NONE guard page below them and recycled
+// instead of unmapped. A mapping of class k is 2^k pages including the guard.
+// Free stacks are chained through their first word: first in the exiting
+// worker's cache, then in the shared pool. Like control blocks they are never
+// given back unless a mapping fails, so the pool grows to the largest burst
+// of threads and later bursts of that size make no system calls.
+void *stack_pool[STACK_CLASSES];
+int stack_pooled[STACK_CLASSES];
+_MyLock stack_pool_lock;
+
+static size_t _pageSize()
+{
+	static size_t page = sysconf(_SC_PAGESIZE);
+	return page;
+}
+
+// smallest class whose usable size holds size bytes, -1 if too large
+static int _stackClass(size_t size)
+{
+	size_t pages = (size + _pageSize() - 1) / _pageSize() + 1;
+	for(int k = 1; k < STACK_CLASSES; k++)
+	{
+		if(((size_t)1 << k) >= pages) return k;
+	}
+	return -1;
+}
+
+static size_t _stackSize(int k)
+{
+	return (((size_t)1 << k) - 1) * _pageSize();
+}
+
+// Give the shared pool's stacks back to the OS. Each one is two mappings, so
+// a big pool can use up the process's mapping limit.
+static void _stackTrim()
+{
+	for(int k = 0; k < STACK_CLASSES; k++)
+	{
+		_lock(&stack_pool_lock);
+		void *stack = stack_pool[k];
+		stack_pool[k] = 0;
+		stack_pooled[k] = 0;
+		_unlock(&stack_pool_lock);
+		while(stack)
+		{
+			void *next = *(void**)stack;
+			munmap((char*)stack - _pageSize(), _stackSize(k) + _pageSize());
+			stack = next;
+		}
+	}
+}
+
+// Map size bytes of stack with a guard page below, trimming the pool and
+// trying again if the OS refuses. Returns the start above the guard, 0 on failure.
+static char *_stackMap(size_t size, int flags)
+{
+	size_t page = _pageSize();
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		char *base = (char*)mmap(0, size + page, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | flags, -1, 0);
+		if(base != MAP_FAILED)
 		{
-			current_thread = 0;
-			setcontext(&main_context);
+			if(mprotect(base, page, PROT_NONE) == 0) return base + page;
+			munmap(base, size + page);
 		}
+		if(attempt == 0) _stackTrim();
+	}
+	return 0;
+}
+
+// w is the worker whose cache to use, 0 goes straight to the shared pool
+static void *_stackAlloc(int k, _MyWorker *w)
+{
+	void *stack = 0;
+	if(w && w->stack_cached[k] > 0)
+	{
+		stack = w->stack_cache[k];
+		w->stack_cache[k] = *(void**)stack;
+		w->stack_cached[k]--;
+		return stack;
+	}
+
+	_lock(&stack_pool_lock);
+	if(stack_pooled[k] > 0)
+	{
+		stack = stack_pool[k];
+		stack_pool[k] = *(void**)stack;
+		stack_pooled[k]--;
+	}
+	_unlock(&stack_pool_lock);
+	if(stack) return stack;
+	return _stackMap(_stackSize(k), 0);
+}
+
+static void _stackFree(void *stack, int k, _MyWorker *w)
+{
+	if(w && w->stack_cached[k] < STACK_CACHE)
+	{
+		*(void**)stack = w->stack_cache[k];
+		w->stack_cache[k] = stack;
+		w->stack_cached[k]++;
+		return;
+	}
+
+	_lock(&stack_pool_lock);
+	*(void**)stack = stack_pool[k];
+	stack_pool[k] = stack;
+	stack_pooled[k]++;
+	_unlock(&stack_pool_lock);
+}
+
+// ****** CONTROL BLOCK POOL ******
+// Control blocks come from slabs and are recycled, never freed. So a stale
+// MyThread handle still points at some control block, which lets MyThreadJoin
+// check parenthood directly instead of looking the child up.
+_MyThread *tcb_pool = 0;
+_MyLock tcb_pool_lock;
+
+static _MyThread *_tcbAlloc(_MyWorker *w)
+{
+	_MyThread *t;
+	if(w && w->tcb_cached > 0)
+	{
+		t = w->tcb_cache;
+		w->tcb_cache = t->next;
+		w->tcb_cached--;
+		return t;
+	}
 
-		// get next thread
-		_MyThread *next = ready_queue.front();
-		ready_queue.pop();
-		current_thread = next;
-		swapcontext(&dummy_context, &next->context);
+	_lock(&tcb_pool_lock);
+	if(!tcb_pool)
+	{
+		_MyThread *slab = new _MyThread[TCB_SLAB]();
+		for(int i = 0; i < TCB_SLAB - 1; i++) slab[i].next = &slab[i + 1];
+		tcb_pool = slab;
 	}
+	t = tcb_pool;
+	tcb_pool = t->next;
+	_unlock(&tcb_pool_lock);
+	return t;
+}
+
+// MyThreadCreateMany carves its threads' stacks out of one mapping and their
+// control blocks out of one slab. Members are not recycled one by one: once
+// the last control block is let go, the stacks are unmapped and the slab
+// joins the pool in one go.
+struct _MyArena {
+	std::atomic<int> live; // members whose control blocks are still in use
+	int n;
+	_MyThread *tcbs;
+	size_t stack_size;
+	void *map; // the stacks, with a guard page below the first
+	size_t map_size;
+};
+
+static void _threadStart(void);
+
+// Arena threads get their context when they first run, so creating them
+// does not fault in a page of every stack
+static void _arenaContext(_MyThread *t)
+{
+	t->context_pending = false;
+	_ctxMake(&t->context, t->stack, t->arena->stack_size, _threadStart);
 }
 
-// Call in the front thread of ready queue
-// swap = true will save current thread context
-void _popNextThread()
+static void _arenaPut(_MyArena *a)
 {
-	// simply exit if ready queue is empty
-	if(ready_queue.empty())
+	if(a->live.fetch_sub(1) > 1) return;
+	munmap(a->map, a->map_size);
+	for(int i = 0; i < a->n; i++)
 	{
-		current_thread = 0;
-		setcontext(&main_context);
+		a->tcbs[i].arena = 0;
+		a->tcbs[i].next = &a->tcbs[i + 1];
 	}
+	_lock(&tcb_pool_lock);
+	a->tcbs[a->n - 1].next = tcb_pool;
+	tcb_pool = a->tcbs;
+	_unlock(&tcb_pool_lock);
+	delete a;
+}
 
-	// get next thread
-	_MyThread *next = ready_queue.front();
-	ready_queue.pop();
+static void _tcbFree(_MyThread *t, _MyWorker *w)
+{
+	if(t->arena)
+	{ // its stack goes with the arena too
+		_arenaPut(t->arena);
+		return;
+	}
+	if(w && w->tcb_cached < TCB_CACHE)
+	{
+		t->next = w->tcb_cache;
+		w->tcb_cache = t;
+		w->tcb_cached++;
+		return;
+	}
 
-	// now swap to next thread
-	_MyThread *tmp = current_thread;
-	current_thread = next;
-	swapcontext(tmp? &tmp->context : &main_context, &next->context);
+	_lock(&tcb_pool_lock);
+	t->next = tcb_pool;
+	tcb_pool = t;
+	_unlock(&tcb_pool_lock);
+}
+
+// hand a worker's cached stacks and control blocks to the shared pools when it stops
+static void _stackFlush(_MyWorker *w)
+{
+	for(int k = 0; k < STACK_CLASSES; k++)
+	{
+		while(w->stack_cached[k] > 0)
+		{
+			void *stack = w->stack_cache[k];
+			w->stack_cache[k] = *(void**)stack;
+			w->stack_cached[k]--;
+			_stackFree(stack, k, 0);
+		}
+	}
+	while(w->tcb_cached > 0)
+	{
+		_MyThread *t = w->tcb_cache;
+		w->tcb_cache = t->next;
+		w->tcb_cached--;
+		_tcbFree(t, 0);
+	}
+}
+
+struct sigaction old_segv_action;
+
+// Turn a hit on the current thread's guard page into a readable message
+static void _segvHandler(int sig, siginfo_t *info, void *ucontext)
+{
+	_MyWorker *w = tls_worker;
+	_MyThread *t = w? w->current : 0;
+	char *addr = (char*)info->si_addr;
+	if(t && addr >= (char*)t->stack - _pageSize() && addr < (char*)t->stack)
+	{
+		static const char msg[] = "mythread: MyThread stack overflow, "
+			"create it with a larger MyThreadAttr.stack_size\n";
+		if(write(2, msg, sizeof(msg) - 1) < 0) {}
+		abort();
+	}
+	// not a MyThread overflow, retry the access with the previous handler
+	sigaction(SIGSEGV, &old_segv_action, 0);
+}
+
+// Per kernel thread setup, the overflow handler needs an alternate signal stack.
+// old_ss receives the kernel thread's previous one, if wanted.
+static void _workerStart(_MyWorker *w, stack_t *old_ss)
+{
+	tls_worker = w;
+	TRACE(_traceStart(w));
+	w->alt_stack = mmap(0, ALT_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(w->alt_stack != MAP_FAILED)
+	{
+		stack_t ss;
+		ss.ss_sp = w->alt_stack;
+		ss.ss_size = ALT_STACK;
+		ss.ss_flags = 0;
+		sigaltstack(&ss, old_ss);
+	}
+	_preemptStart(w);
+}
+
+static void _workerStop(_MyWorker *w, stack_t *old_ss)
+{
+	_preemptStop(w);
+	_stackFlush(w);
+	if(w->alt_stack != MAP_FAILED)
+	{
+		stack_t ss;
+		memset(&ss, 0, sizeof(ss));
+		ss.ss_flags = SS_DISABLE;
+		sigaltstack(old_ss? old_ss : &ss, 0);
+		munmap(w->alt_stack, ALT_STACK);
+	}
+	tls_worker = 0;
+}
+
+// Called on every switch. pass_end: nothing else to run right now.
+static void _checkEvents(_MyWorker *w, bool pass_end)
+{
+	// A pass over our ready queue ends once we have switched as many times as
+	// there were threads in it when the pass began. With many busy threads it
+	// never runs dry, but the waiters are still only a pass behind.
+	if(--w->pass_left <= 0) pass_end = true;
+	if(pass_end) w->pass_left = w->nready.load(std::memory_order_relaxed) + 1;
+
+	// submit the file I/O queued during the pass
+	if(pass_end) _uringSubmit();
+
+	// threads that keep the ready queues busy must not starve the waiters
+	bool interval = ++w->ticks % POLL_INTERVAL == 0;
+	if(npolled.load(std::memory_order_relaxed) > 0)
+	{
+		if(interval) _pollNow();
+		if(interval || pass_end) _timerRun();
+	}
+}
+
+// Runs first thing in whichever context we have just switched to
+static void _finishSwitch()
+{
+	_MyWorker *w = _worker();
+	if(w->post_unlock)
+	{
+		_unlock(w->post_unlock);
+		w->post_unlock = 0;
+	}
+	if(w->post_ready)
+	{
+		_pushReady(w, w->post_ready);
+		w->post_ready = 0;
+	}
+	if(w->post_free_stack)
+	{
+		_stackFree(w->post_free_stack, w->post_free_class, w);
+		w->post_free_stack = 0;
+	}
+	if(w->post_free)
+	{
+		_tcbFree(w->post_free, w);
+		w->post_free = 0;
+	}
+
+	_checkEvents(w, false);
+}
+
+// Switch this worker to next, or to its scheduler loop if next is 0.
+// save = 0 throws the current context away.
+// Coroutines run on the scheduler loop's stack, so switching to one means
+// switching to the loop, which resumes it in _runCoroutines.
+static void _switchTo(_MyWorker *w, _MyContext *save, _MyThread *next)
+{
+	_MyThread *prev = w->current;
+	if(prev && prev->coroutine && save != &w->sched_context)
+	{ // a coroutine parking itself, the switch is done once it has returned to _runCoroutines
+		w->parked = true;
+		w->parked_next = next;
+		return;
+	}
+	TRACE(_traceSwitch(w, prev, next, !save || (prev && prev->exited)? TRACE_EXIT : w->post_ready == prev? TRACE_YIELD : TRACE_BLOCK));
+	_charge(w);
+	w->current = next;
+	if(next)
+	{
+		next->preempt_pending = false; // a fresh quantum
+		if(next->context_pending) _arenaContext(next);
+	}
+	_MyContext *to = next && !next->coroutine? &next->context : &w->sched_context;
+	if(to == save) {} // the scheduler loop going on with a coroutine
+	else if(save) _ctxSwitch(save, to);
+	else _ctxJump(to);
+	_finishSwitch();
+}
+
+// Resume coroutines for as long as the scheduler loop has switched to one
+static void _runCoroutines(_MyWorker *w)
+{
+	while(w->current && w->current->coroutine)
+	{
+		_MyThread *co = w->current;
+		if(co->timer.wheel) _timerDone(co); // back from MyThreadSleep
+		w->parked = false;
+		co->start_funct(co->args);
+		_MyThread *next;
+		if(w->parked) next = w->parked_next;
+		else
+		{ // returned without parking, same as a yield
+			w->post_ready = co;
+			next = _nextReady(w, ANY_LEVEL);
+		}
+		_switchTo(w, &w->sched_context, next);
+	}
+}
+
+// Block the current thread, which must already be on some wait list guarded by held.
+// held is released once the thread's context has been saved, so whoever wakes it
+// can never resume a half-saved context.
+void _popNextThread(_MyLock *held)
+{
+	_MyWorker *w = _worker();
+	_MyThread *self = w->current;
+	nrunnable.fetch_sub(1);
+	w->post_unlock = held;
+	_switchTo(w, &self->context, _nextReady(w, ANY_LEVEL));
+}
+
+static void _idle(_MyWorker *w)
+{
+	for(int i = 0; i < IDLE_SPINS; i++)
+	{
+		if(_anyReady() || _done()) return;
+		_cpuRelax();
+	}
+
+	_preemptIdle(w, true);
+	if(npolled.load() > 0 && !polling.exchange(true))
+	{ // sleep in epoll_wait until the next timer is due, _pushReady kicks us
+		// if work shows up meanwhile and _timerArm if an earlier timer does
+		poll_deadline.store(0);
+		poll_blocked.store(true);
+		uint64_t due = _timerDue();
+		poll_deadline.store(due);
+		int64_t timeout = -1;
+		if(_anyReady()) timeout = 0;
+		else if(due != UINT64_MAX)
+		{
+			uint64_t now = _now();
+			timeout = due > now? due - now : 0;
+		}
+		_ioPoll(timeout);
+		poll_blocked.store(false);
+		polling.store(false);
+		_preemptIdle(w, false);
+		_timerRun();
+		return;
+	}
+
+	pthread_mutex_lock(&idle_lock);
+	nsleeping.fetch_add(1);
+	if(!_anyReady() && !_done())
+	{ // with timers armed wake up in time to take over polling, should the
+		// poller be busy running threads by then
+		uint64_t due = npolled.load() > 0? _timerDue() : UINT64_MAX;
+		if(due == UINT64_MAX) pthread_cond_wait(&idle_cond, &idle_lock);
+		else
+		{
+			uint64_t now = _now();
+			uint64_t wait = due > now? due - now : 0;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			wait += ts.tv_nsec;
+			ts.tv_sec += wait / 1000000000;
+			ts.tv_nsec = wait % 1000000000;
+			pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+		}
+	}
+	nsleeping.fetch_sub(1);
+	pthread_mutex_unlock(&idle_lock);
+	_preemptIdle(w, false);
+}
+
+// Scheduler loop of a worker, returns when no thread can run anymore
+static void _schedule(_MyWorker *w)
+{
+	while(true)
+	{
+		_MyThread *next = _nextReady(w, ANY_LEVEL);
+		if(next)
+		{
+			_switchTo(w, &w->sched_context, next);
+			_runCoroutines(w);
+			continue;
+		}
+		if(_done())
+		{ // everything has exited (or is blocked forever), let the other workers go too
+			pthread_mutex_lock(&idle_lock);
+			pthread_cond_broadcast(&idle_cond);
+			pthread_mutex_unlock(&idle_lock);
+			return;
+		}
+		_idle(w);
+	}
+}
+
+static void *_workerMain(void *arg)
+{
+	_MyWorker *w = (_MyWorker*)arg;
+	_workerStart(w, 0);
+	_schedule(w);
+	_workerStop(w, 0);
+	return 0;
+}
+
+static void _threadStart(void)
+{
+	_finishSwitch();
+	_MyThread *self = _worker()->current;
+	self->preempt_off--; // out of the library
+	self->start_funct(self->args);
+	MyThreadExit(); // in case the start function fell out
+}
+
+// Set up the control block of a new thread running on stack, as a child of
+// parent, except for its context and linking it into parent's children list
+static void _tcbInit(_MyThread *t, void *stack, void(*start_funct)(void *), void *args, _MyThread *parent)
+{
+	t->stack = stack;
+	t->start_funct = start_funct;
+	t->args = args;
+	t->first_child = 0;
+	t->joining = 0;
+	t->exited = false;
+	t->priority = parent? parent->priority : MYTHREAD_PRIORITY_DEFAULT;
+	t->level = t->priority;
+	t->epoch = mlfq_epoch.load(std::memory_order_relaxed);
+	t->used = 0;
+	t->preempt_off = 1; // until _threadStart is through
+	t->preempt_pending = false;
+	t->sibling_prev = 0;
+	t->sibling_next = 0;
+	t->parent = parent;
+	t->context_pending = false;
+	t->coroutine = false;
+	TRACE(_traceCreate(t));
 }
 
 /*
@@ -80,57 +922,194 @@ void _popNextThread()
  */
 MyThread MyThreadCreate (void(*start_funct)(void *), void *args)
 {
-	_MyThread *new_thread = new _MyThread();
-	new_thread->parent = current_thread;
+	return MyThreadCreateAttr(start_funct, args, 0);
+}
+
+/*
+ * Same as MyThreadCreate, with the new thread's properties taken from attr.
+ * A zeroed MyThreadAttr (or attr = 0) gives the defaults.
+ * Returns 0 if the stack cannot be allocated.
+ */
+MyThread MyThreadCreateAttr(void(*start_funct)(void *), void *args, const MyThreadAttr *attr)
+{
+	_MyNoPreempt np;
+	int stack_class = _stackClass(attr && attr->stack_size? attr->stack_size : THREAD_STACK);
+	_MyWorker *w = _worker();
+	void *stack = stack_class < 0? 0 : _stackAlloc(stack_class, w);
+	if(!stack) return 0;
+
+	_MyThread *current_thread = w? w->current : 0; // 0 from MyThreadCreateExternal
+	_MyThread *new_thread = _tcbAlloc(w);
+	new_thread->stack_class = stack_class;
+	new_thread->arena = 0;
+	_tcbInit(new_thread, stack, start_funct, args, current_thread);
+	_ctxMake(&new_thread->context, stack, _stackSize(stack_class), _threadStart);
 	if(current_thread)
 	{ // newly created is not the "main" thread, so add its to current_thread's children list
-		current_thread->children.insert(new_thread);
+		_lock(&current_thread->lock);
+		new_thread->sibling_next = current_thread->first_child;
+		if(current_thread->first_child) current_thread->first_child->sibling_prev = new_thread;
+		current_thread->first_child = new_thread;
+		_unlock(&current_thread->lock);
 	}
-	ready_queue.push(new_thread);
-
-	// make context for the new thread
-	getcontext(&new_thread->context);
-	new_thread->context.uc_link = &dummy_context;
-	new_thread->context.uc_stack.ss_sp = malloc(THREAD_STACK);
-	new_thread->context.uc_stack.ss_size = THREAD_STACK;
-	new_thread->context.uc_stack.ss_flags = 0;
-	makecontext(&new_thread->context, (void(*)())start_funct, 1, args);
 
+	_wake(new_thread);
 	return (MyThread) new_thread;
 }
 
+/*
+ * Creates n threads at once, thread i running start_funct(args[i]) (all get 0
+ * if args is 0), and stores their handles in threads unless it is 0. attr is
+ * as for MyThreadCreateAttr. The stacks come from one mapping and the control
+ * blocks from one allocation, and all threads are queued with a single
+ * operation. There are no guard pages between the stacks.
+ * Returns 0 on success, -1 if n < 1 or the memory cannot be allocated.
+ */
+int MyThreadCreateMany(int n, void(*start_funct)(void *), void **args, const MyThreadAttr *attr, MyThread *threads)
+{
+	_MyNoPreempt np;
+	if(n < 1) return -1;
+	size_t page = _pageSize();
+	size_t stack_size = ((attr && attr->stack_size? attr->stack_size : THREAD_STACK) + page - 1) & ~(page - 1);
+	size_t map_size = page + n * stack_size;
+	char *stack = _stackMap(map_size - page, MAP_NORESERVE);
+	if(!stack) return -1;
+	char *map = stack - page;
+
+	_MyArena *a = new _MyArena();
+	a->live.store(n, std::memory_order_relaxed);
+	a->n = n;
+	a->tcbs = new _MyThread[n]();
+	a->stack_size = stack_size;
+	a->map = map;
+	a->map_size = map_size;
+
+	_MyWorker *w = _worker();
+	_MyThread *current_thread = w->current;
+	for(int i = 0; i < n; i++)
+	{ // chain them up as siblings and as ready queue entries
+		_MyThread *t = &a->tcbs[i];
+		t->stack_class = -1;
+		t->arena = a;
+		_tcbInit(t, stack, start_funct, args? args[i] : 0, current_thread);
+		t->context_pending = true;
+		stack += stack_size;
+		t->prev = i > 0? t - 1 : 0;
+		t->next = i < n - 1? t + 1 : 0;
+		t->sibling_prev = t->prev;
+		t->sibling_next = t->next;
+		if(threads) threads[i] = (MyThread)t;
+	}
+	_MyThread *first = &a->tcbs[0];
+	_MyThread *last = &a->tcbs[n - 1];
+	if(current_thread)
+	{
+		_lock(&current_thread->lock);
+		last->sibling_next = current_thread->first_child;
+		if(current_thread->first_child) current_thread->first_child->sibling_prev = last;
+		current_thread->first_child = first;
+		_unlock(&current_thread->lock);
+	}
+
+	nrunnable.fetch_add(n);
+	_pushReadyChain(w, first, last, n);
+	return 0;
+}
+
+/*
+ * Creates a stackless coroutine: a scheduler entry that is run by calling
+ * resume(arg) on the worker's own stack. It is a child of the invoking thread
+ * like any thread, can be joined, and is never preempted. resume runs the
+ * coroutine up to its next suspension; a library call that would block it
+ * (MySemaphoreWait, MyThreadJoin, MyThreadJoinAll, MyThreadYield,
+ * MyThreadSleep, MyThreadWaitFd and MyThreadExit, no others) instead returns
+ * right away with MyCoroutineParked() true, and the coroutine has to suspend
+ * before resume returns. It is resumed again once woken. This is for
+ * frontends like mythread_coro.h.
+ */
+MyThread MyCoroutineCreate(void(*resume)(void *), void *arg)
+{
+	_MyNoPreempt np;
+	_MyWorker *w = _worker();
+	_MyThread *current_thread = w->current;
+	_MyThread *co = _tcbAlloc(w);
+	co->stack_class = -1;
+	co->arena = 0;
+	_tcbInit(co, 0, resume, arg, current_thread); // preempt_off stays 1 for good
+	co->coroutine = true;
+	if(current_thread)
+	{
+		_lock(&current_thread->lock);
+		co->sibling_next = current_thread->first_child;
+		if(current_thread->first_child) current_thread->first_child->sibling_prev = co;
+		current_thread->first_child = co;
+		_unlock(&current_thread->lock);
+	}
+
+	_wake(co);
+	return (MyThread)co;
+}
+
+/*
+ * Returns 1 if the invoking coroutine has been parked by the library call it
+ * just made and must suspend, 0 if that call completed (or the caller is not
+ * a coroutine).
+ */
+int MyCoroutineParked(void)
+{
+	_MyWorker *w = _worker();
+	return w && w->current && w->current->coroutine && w->parked;
+}
+
 /*
  * Terminates the invoking thread.
  * Note: all MyThreads are required to invoke this function.
  * Do not allow functions to “fall out” of the start function.
+ * The destructors of the thread's key values are called first.
+ * Called from a coroutine (see MyCoroutineCreate) it returns, and the
+ * coroutine must then suspend for good.
  */
 void MyThreadExit(void)
 {
-	_MyThread *parent = (_MyThread*)current_thread->parent;
+	_keysExit(); // user code, so not from inside the library
+	_MyNoPreempt np;
+	_MyWorker *w = _worker();
+	_MyThread *current_thread = w->current;
+
+	_MyThread *parent = current_thread->parent;
 	if(parent)
-	{ // parent thread is active
-		parent->children.erase(current_thread); // delete thread from parent's children list
-		if(!parent->blocked_by.empty())
-		{ // unblock parent if needed
-			parent->blocked_by.erase(current_thread);
-			if(parent->blocked_by.empty())
-			{ // unblock parent thread, i.e. push it to the end of ready queue
-				ready_queue.push(parent);
-			}
+	{ // the parent's control block stays around as long as it has children
+		_lock(&parent->lock);
+		// delete thread from parent's children list
+		if(current_thread->sibling_prev) current_thread->sibling_prev->sibling_next = current_thread->sibling_next;
+		else parent->first_child = current_thread->sibling_next;
+		if(current_thread->sibling_next) current_thread->sibling_next->sibling_prev = current_thread->sibling_prev;
+		current_thread->parent = 0;
+
+		if(parent->joining == current_thread || (parent->joining == JOIN_ALL && !parent->first_child))
+		{ // unblock parent thread, i.e. push it to the end of ready queue
+			parent->joining = 0;
+			_wake(parent);
 		}
+		bool last_orphan = parent->exited && !parent->first_child;
+		_unlock(&parent->lock);
+		if(last_orphan) _tcbFree(parent, w);
 	}
 
-	// all children no longer have parent
-	if(!current_thread->children.empty())
+	// Our children still point at us, so leave the control block to the last
+	// of them. We are still running on the stack, so the next context frees it.
+	_lock(&current_thread->lock);
+	current_thread->exited = true;
+	if(current_thread->stack && !current_thread->arena)
 	{
-		std::set<void*>::iterator it;
-		_MyThread *child;
-		for(it = current_thread->children.begin(); it != current_thread->children.end(); ++it)
-		{
-			child = (_MyThread*)*it;
-			child->parent = 0;
-		}
+		w->post_free_stack = current_thread->stack;
+		w->post_free_class = current_thread->stack_class;
 	}
+	if(!current_thread->first_child) w->post_free = current_thread;
+	_unlock(&current_thread->lock);
+
+	nrunnable.fetch_sub(1);
+	_switchTo(w, 0, _nextReady(w, ANY_LEVEL));
 }
 
 /*
@@ -140,13 +1119,42 @@ void MyThreadExit(void)
  */
 void MyThreadYield(void)
 {
-	if(!ready_queue.empty())
+	_MyNoPreempt np;
+	_MyWorker *w = _worker();
+	_charge(w); // a thread that used up its slice may sink below the others now
+	int level = policy->level(w->current); // only make way for threads at least as urgent
+	_MyThread *next = _nextReady(w, level);
+	if(!next)
+	{ // nothing else to run, unless a waiter's event has come in
+		_checkEvents(w, true);
+		next = _nextReady(w, level);
+	}
+	if(next)
 	{ // there are other threads in the ready queue, may swap
-		ready_queue.push(current_thread); // back to the ready queue and live another day
-		_popNextThread();
+		_MyThread *current_thread = w->current;
+		w->post_ready = current_thread; // back to the ready queue and live another day
+		_switchTo(w, &current_thread->context, next);
 	}
 }
 
+/*
+ * Sets the priority of thread, or of the invoking thread if thread is 0.
+ * Priorities go from 0, which runs first, to MYTHREAD_PRIORITIES - 1; new
+ * threads inherit their creator's. Under MYTHREAD_POLICY_MLFQ this is the
+ * level the thread starts at and is lifted back to. Takes effect the next
+ * time the thread is queued. Returns 0 on success, -1 if priority is out of range.
+ */
+int MyThreadSetPriority(MyThread thread, int priority)
+{
+	_MyNoPreempt np;
+	_MyThread *t = thread? (_MyThread*)thread : _worker()->current;
+	if(!t || priority < 0 || priority >= MYTHREAD_PRIORITIES) return -1;
+	t->priority = priority;
+	t->level = priority;
+	t->used = 0;
+	return 0;
+}
+
 /*
  * Joins the invoking function with the specified child thread.
  * If the child has already terminated, do not block.
@@ -156,15 +1164,20 @@ void MyThreadYield(void)
  */
 int MyThreadJoin(MyThread thread)
 {
-	if(current_thread->children.count(thread) != 0)
+	_MyNoPreempt np;
+	_MyThread *current_thread = _worker()->current;
+	_MyThread *child = (_MyThread*)thread;
+	_lock(&current_thread->lock);
+	if(child && child->parent == current_thread)
 	{ // thread is a child of current thread
 		// we should flag current thread as blocked by input thread, and then call next thread in the ready queue
-		current_thread->blocked_by.insert(thread);
-		_popNextThread();
+		current_thread->joining = child;
+		_popNextThread(&current_thread->lock);
 		return 0;
 	}
 	else
 	{ // not a child, return error
+		_unlock(&current_thread->lock);
 		return -1;
 	}
 }
@@ -174,37 +1187,83 @@ int MyThreadJoin(MyThread thread)
  */
 void MyThreadJoinAll(void)
 {
-	if(!current_thread->children.empty())
-	{
-		std::set<void*>::iterator it;
-		for(it = current_thread->children.begin(); it != current_thread->children.end(); ++it)
-		{ // loop through all children
-			current_thread->blocked_by.insert(*it);
-		}
-		_popNextThread();
+	_MyNoPreempt np;
+	_MyThread *current_thread = _worker()->current;
+	_lock(&current_thread->lock);
+	if(current_thread->first_child)
+	{ // woken by the last child to exit
+		current_thread->joining = JOIN_ALL;
+		_popNextThread(&current_thread->lock);
 	}
+	else _unlock(&current_thread->lock);
+}
+
+/*
+ * Choose how ready threads are picked, one of MYTHREAD_POLICY_*:
+ * PRIORITY (the default) always runs the most urgent priority first,
+ * FIFO ignores priorities, and MLFQ moves a thread down a level each time it
+ * has run for a slice (the quantum, if there is one) so threads that mostly
+ * wait stay ahead of CPU hogs. Call before MyThreadInit.
+ * Returns 0 on success, -1 if policy is unknown or the threads are running.
+ */
+int MyThreadSetPolicy(int policy_id)
+{
+	if(workers || policy_id < 0 || policy_id >= (int)(sizeof(policies) / sizeof(policies[0]))) return -1;
+	policy = &policies[policy_id];
+	return 0;
 }
 
 bool init = false;
-void MyThreadInit(void(*start_funct)(void *), void *args)
+void MyThreadInitWorkers(void(*start_funct)(void *), void *args, int n)
 {
 	if(!init)
 	{
 		init = true;
 
-		// create a context served as uc_link for all threads
-		getcontext(&dummy_context);
-		dummy_context.uc_link = 0;
-		dummy_context.uc_stack.ss_sp = dummy_stack;
-		dummy_context.uc_stack.ss_size = THREAD_STACK;
-		dummy_context.uc_stack.ss_flags = 0;
-		makecontext(&dummy_context, dummy_func, 0);
+		if(n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+		if(n <= 0) n = 1;
+		if(n > MAX_WORKERS) n = MAX_WORKERS;
+		nworkers = n;
+		workers = new _MyWorker[n]();
+		for(int i = 0; i < n; i++) workers[i].seed = i + 1;
+
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = _segvHandler;
+		sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGSEGV, &sa, &old_segv_action);
+		_ioInit();
+		_preemptInit();
 
+		// the Unix process becomes worker 0
+		stack_t old_ss;
+		_workerStart(&workers[0], &old_ss);
+		running.store(true);
 		MyThreadCreate(start_funct, args);
-		_popNextThread();
+		for(int i = 1; i < n; i++)
+		{
+			if(pthread_create(&workers[i].tid, 0, _workerMain, &workers[i]) != 0)
+			{
+				perror("MyThreadInitWorkers: pthread_create");
+				exit(1);
+			}
+		}
+		_schedule(&workers[0]);
+		for(int i = 1; i < n; i++) pthread_join(workers[i].tid, 0);
+		running.store(false);
+		_workerStop(&workers[0], &old_ss);
+		sigaction(SIGSEGV, &old_segv_action, 0);
+		_preemptFini();
+		_ioFini();
 	}
 }
 
+void MyThreadInit(void(*start_funct)(void *), void *args)
+{
+	MyThreadInitWorkers(start_funct, args, 1);
+}
+
 /*
  * Create a semaphore. Set the initial value to initialValue, which must be non-negative.
  * A positive initial value has the same effect as invoking MySemaphoreSignal the same number of times.
@@ -220,41 +1279,142 @@ MySemaphore MySemaphoreInit(int initialValue)
 // Signal semaphore sem. The invoking thread is not pre-empted.
 void MySemaphoreSignal(MySemaphore sem)
 {
+	_MyNoPreempt np;
 	_MySem *ms = (_MySem*)sem;
 	if(ms)
 	{
-		if(ms->block_queue.empty()) ++ms->value;
+		_lock(&ms->lock);
+		_MyThread *t;
+		while((t = _qPopFront(&ms->block_queue)))
+		{
+			t->wait_queue = 0;
+			if(_waitClaim(t)) break; // otherwise its timer is waking it
+		}
+		if(!t) ++ms->value;
 		else
 		{ // put the front thread back to ready queue, semaphore value stays the same
-			ready_queue.push(ms->block_queue.front());
-			ms->block_queue.pop();
+			_wake(t);
 		}
+		_unlock(&ms->lock);
 	}
 }
 
 // Wait on semaphore sem.
 void MySemaphoreWait(MySemaphore sem)
 {
+	_MyNoPreempt np;
 	_MySem *ms = (_MySem*)sem;
 	if(ms)
 	{
-		if(ms->value > 0) --ms->value; // no need to block
+		_lock(&ms->lock);
+		if(ms->value > 0)
+		{ // no need to block
+			--ms->value;
+			_unlock(&ms->lock);
+		}
 		else
 		{
-			ms->block_queue.push(current_thread);
-			_popNextThread();
+			_MyThread *self = _worker()->current;
+			_qPush(&ms->block_queue, self);
+			self->wait_state.store(WAIT_BLOCKED, std::memory_order_relaxed);
+			_popNextThread(&ms->lock);
 		}
 	}
 }
 
+/*
+ * Wait on semaphore sem for at most ns nanoseconds.
+ * Returns 0 once the semaphore has been taken, -1 on timeout.
+ */
+int MySemaphoreTimedWait(MySemaphore sem, unsigned long long ns)
+{
+	_MyNoPreempt np;
+	_MySem *ms = (_MySem*)sem;
+	if(!ms) return -1;
+	_lock(&ms->lock);
+	if(ms->value > 0)
+	{
+		--ms->value;
+		_unlock(&ms->lock);
+		return 0;
+	}
+	if(ns == 0)
+	{
+		_unlock(&ms->lock);
+		return -1;
+	}
+
+	_MyThread *self = _worker()->current;
+	_qPush(&ms->block_queue, self);
+	self->wait_lock = &ms->lock;
+	self->wait_queue = &ms->block_queue;
+	self->wait_state.store(WAIT_BLOCKED, std::memory_order_relaxed);
+	_timerArm(self, _now() + ns);
+	_popNextThread(&ms->lock);
+	return _timerDone(self)? -1 : 0;
+}
+
 // Destroy semaphore sem. Do not destroy semaphore if any threads are blocked on the queue. Return 0 on success, -1 on failure.
 int MySemaphoreDestroy(MySemaphore sem)
 {
+	_MyNoPreempt np;
 	_MySem *ms = (_MySem*)sem;
-	if(ms && ms->block_queue.empty())
+	if(ms)
 	{
-		delete ms;
-		return 0;
+		_lock(&ms->lock);
+		if(!ms->block_queue.head)
+		{
+			delete ms;
+			return 0;
+		}
+		_unlock(&ms->lock);
 	}
 	return -1;
 }
+
+// ****** CALLS FROM OTHER KERNEL THREADS ******
+// A kernel thread that is not a worker has no current thread and no ready
+// queue, so whatever it makes ready goes through _inject.
+
+/*
+ * Keeps MyThreadInit from returning, even with every thread blocked, until
+ * the matching MyThreadExternalRelease. Hold while some kernel thread outside
+ * the library may still call the routines below, e.g. for as long as a
+ * completion callback is registered. May be called from any kernel thread.
+ */
+void MyThreadExternalHold(void)
+{
+	npolled.fetch_add(1);
+}
+
+/*
+ * Undoes a MyThreadExternalHold. May be called from any kernel thread.
+ */
+void MyThreadExternalRelease(void)
+{
+	npolled.fetch_sub(1);
+	_kickIdle(true); // they may all be done now
+}
+
+/*
+ * Same as MySemaphoreSignal, for kernel threads other than the library's own.
+ * A thread woken this way is queued on whichever worker next looks for work.
+ * Returns 0 on success, -1 if sem is 0 or the threads are not running.
+ */
+int MySemaphoreSignalExternal(MySemaphore sem)
+{
+	if(!sem || !running.load()) return -1;
+	MySemaphoreSignal(sem);
+	return 0;
+}
+
+/*
+ * Same as MyThreadCreate, for kernel threads other than the library's own.
+ * The new thread has no parent, so nobody joins it.
+ * Returns 0 if the stack cannot be allocated or the threads are not running.
+ */
+MyThread MyThreadCreateExternal(void(*start_funct)(void *), void *args)
+{
+	if(!running.load()) return 0;
+	return MyThreadCreateAttr(start_funct, args, 0);
+}
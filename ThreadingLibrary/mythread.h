@@ -14,6 +14,10 @@
 #ifndef MYTHREAD_H
 #define MYTHREAD_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
 // Leave these definitions alone.  They are opaque handles.  The
 // public definition of these should not contain the internal
 // structure.
@@ -24,11 +28,77 @@
 //		MyThread parameter_name = (MyThread)internal_name;
 typedef void *MyThread;
 typedef void *MySemaphore;
+typedef void *MyChannel;
+typedef void *MyFuture;
+typedef void *MyTaskGroup;
+
+// Storage for the synchronization objects below, which live wherever the
+// caller puts them. Only use them through the MyMutex/MyCond/MyRWLock/
+// MyBarrier calls. A zero-filled object is ready to use (barriers still
+// need MyBarrierInit), and so is one set to its initializer.
+typedef struct { void *opaque[3]; } MyMutex;
+typedef struct { void *opaque[4]; } MyCond;
+typedef struct { void *opaque[5]; } MyRWLock;
+typedef struct { void *opaque[4]; } MyBarrier;
+
+#define MYTHREAD_MUTEX_INITIALIZER {{0}}
+#define MYTHREAD_COND_INITIALIZER {{0}}
+#define MYTHREAD_RWLOCK_INITIALIZER {{0}}
+
+// MyBarrierWait's return value in exactly one of the threads it releases
+#define MYTHREAD_BARRIER_SERIAL 1
+
+// One case of a MyChannelSelect
+typedef struct {
+	MyChannel channel; // 0 never goes through
+	int send; // 1 to send *elem, 0 to receive into elem
+	void *elem;
+	int closed; // set by MyChannelSelect if the case went through because channel is closed
+} MyChannelCase;
+
+// What MyThreadWaitFd waits for
+#define MYTHREAD_FD_READ 1
+#define MYTHREAD_FD_WRITE 2
+
+// Thread priorities, 0 runs first
+#define MYTHREAD_PRIORITIES 32
+#define MYTHREAD_PRIORITY_DEFAULT 16
+
+// Scheduling policies, see MyThreadSetPolicy
+enum {
+	MYTHREAD_POLICY_PRIORITY, // strict priorities, FIFO within one (default)
+	MYTHREAD_POLICY_FIFO, // one FIFO, priorities are ignored
+	MYTHREAD_POLICY_MLFQ // multi-level feedback queue starting at the priority
+};
+
+// Run time statistics of a thread, see MyThreadGetStats
+typedef struct {
+	unsigned long long switches; // times the thread was switched to
+	unsigned long long yields; // times it gave up the CPU while still ready
+	unsigned long long cpu_ns; // running
+	unsigned long long ready_ns; // waiting in a ready queue
+	unsigned long long blocked_ns; // waiting for a semaphore, a child, I/O, a timer...
+} MyThreadStats;
+
+// Thread-specific data, see MyThreadKeyCreate
+#define MYTHREAD_KEYS_MAX 16
+typedef unsigned int MyThreadKey;
+
+// Optional properties of a new thread. Zero fields take the defaults.
+typedef struct {
+	size_t stack_size; // usable stack in bytes, default 64 KB
+} MyThreadAttr;
 
 // ****** THREAD OPERATIONS ****** 
 // Create a new thread.
 MyThread MyThreadCreate(void(*start_funct)(void *), void *args);
 
+// Create a new thread with the given properties
+MyThread MyThreadCreateAttr(void(*start_funct)(void *), void *args, const MyThreadAttr *attr);
+
+// Create n threads at once, thread i gets args[i]
+int MyThreadCreateMany(int n, void(*start_funct)(void *), void **args, const MyThreadAttr *attr, MyThread *threads);
+
 // Yield invoking thread
 void MyThreadYield(void);
 
@@ -41,6 +111,23 @@ void MyThreadJoinAll(void);
 // Terminate invoking thread
 void MyThreadExit(void);
 
+// Set the priority of thread, 0 for the invoking thread
+int MyThreadSetPriority(MyThread thread, int priority);
+
+// Suspend invoking thread for at least ns nanoseconds
+void MyThreadSleep(unsigned long long ns);
+
+// ****** THREAD-SPECIFIC DATA ******
+// Create a key, destructor (may be 0) is called on values left at MyThreadExit
+int MyThreadKeyCreate(MyThreadKey *key, void (*destructor)(void *));
+
+// Delete a key, without calling its destructor
+int MyThreadKeyDelete(MyThreadKey key);
+
+// Get or set the invoking thread's value for key
+void *MyThreadGetSpecific(MyThreadKey key);
+int MyThreadSetSpecific(MyThreadKey key, const void *value);
+
 // ****** SEMAPHORE OPERATIONS ****** 
 // Create a semaphore
 MySemaphore MySemaphoreInit(int initialValue);
@@ -51,12 +138,142 @@ void MySemaphoreSignal(MySemaphore sem);
 // Wait on a semaphore
 void MySemaphoreWait(MySemaphore sem);
 
+// Wait on a semaphore for at most ns nanoseconds, -1 on timeout
+int MySemaphoreTimedWait(MySemaphore sem, unsigned long long ns);
+
 // Destroy on a semaphore
 int MySemaphoreDestroy(MySemaphore sem);
 
+// ****** MUTEX, CONDITION VARIABLE, RWLOCK AND BARRIER OPERATIONS ******
+// Uncontended locking is a single atomic instruction
+int MyMutexInit(MyMutex *mutex);
+void MyMutexLock(MyMutex *mutex);
+int MyMutexTryLock(MyMutex *mutex);
+void MyMutexUnlock(MyMutex *mutex);
+int MyMutexDestroy(MyMutex *mutex);
+
+int MyCondInit(MyCond *cond);
+void MyCondWait(MyCond *cond, MyMutex *mutex);
+void MyCondSignal(MyCond *cond);
+void MyCondBroadcast(MyCond *cond);
+int MyCondDestroy(MyCond *cond);
+
+// Any number of readers or one writer
+int MyRWLockInit(MyRWLock *rwlock);
+void MyRWLockRdLock(MyRWLock *rwlock);
+void MyRWLockWrLock(MyRWLock *rwlock);
+void MyRWLockUnlock(MyRWLock *rwlock);
+int MyRWLockDestroy(MyRWLock *rwlock);
+
+// Releases count threads at a time
+int MyBarrierInit(MyBarrier *barrier, int count);
+int MyBarrierWait(MyBarrier *barrier);
+int MyBarrierDestroy(MyBarrier *barrier);
+
+// ****** CHANNEL OPERATIONS ******
+// Create a channel of elem_size byte items buffering up to capacity (0: unbuffered)
+MyChannel MyChannelCreate(size_t elem_size, size_t capacity);
+
+// Send or receive one item, -1 once the channel is closed
+int MyChannelSend(MyChannel channel, const void *elem);
+int MyChannelRecv(MyChannel channel, void *elem);
+
+// Send all n items / receive between 1 and n items, returns the count
+size_t MyChannelSendMany(MyChannel channel, const void *elems, size_t n);
+size_t MyChannelRecvMany(MyChannel channel, void *elems, size_t n);
+
+// Carry out one of the cases that can go through, returns its index
+int MyChannelSelect(MyChannelCase *cases, int n, int block);
+
+// Close a channel, blocked senders and receivers return
+void MyChannelClose(MyChannel channel);
+
+// Destroy a channel
+int MyChannelDestroy(MyChannel channel);
+
+// ****** TASK OPERATIONS ******
+// Run funct(args) in a new thread, its return value is kept in the future
+MyFuture MyFutureCreate(void *(*funct)(void *), void *args);
+
+// Wait for a future's value
+void *MyFutureGet(MyFuture future);
+
+// 1 if the value is there, 0 otherwise
+int MyFutureReady(MyFuture future);
+
+// Destroy a finished future
+int MyFutureDestroy(MyFuture future);
+
+// Futures that can be waited for all at once or as they finish
+MyTaskGroup MyTaskGroupCreate(void);
+MyFuture MyTaskGroupSpawn(MyTaskGroup group, void *(*funct)(void *), void *args);
+void MyTaskGroupWaitAll(MyTaskGroup group);
+MyFuture MyTaskGroupWaitAny(MyTaskGroup group);
+int MyTaskGroupDestroy(MyTaskGroup group);
+
+// Call body on chunks of [begin, end), in parallel across the workers
+void MyParallelFor(long begin, long end, long grain, void (*body)(long begin, long end, void *args), void *args);
+
+// ****** I/O OPERATIONS ******
+// Like read/write/accept/connect, but block only the invoking thread.
+// The fd is made non-blocking on first use.
+ssize_t MyThreadRead(int fd, void *buf, size_t count);
+ssize_t MyThreadWrite(int fd, const void *buf, size_t count);
+int MyThreadAccept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+int MyThreadConnect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+
+// Close a fd used with the calls above
+int MyThreadClose(int fd);
+
+// Wait for a non-blocking fd to become readable/writable (MYTHREAD_FD_*)
+int MyThreadWaitFd(int fd, int events);
+
+// Like pread/pwrite/fsync, through io_uring when available
+ssize_t MyThreadPread(int fd, void *buf, size_t count, off_t offset);
+ssize_t MyThreadPwrite(int fd, const void *buf, size_t count, off_t offset);
+int MyThreadFsync(int fd);
+
+// ****** PREEMPTION ******
+// Keep the invoking thread from being preempted, sections nest
+void MyThreadPreemptDisable(void);
+void MyThreadPreemptEnable(void);
+
+// ****** TRACING ******
+// Only recorded when the library is built with TRACE=yes, otherwise these return -1
+// Run time statistics of thread, 0 for the invoking thread
+int MyThreadGetStats(MyThread thread, MyThreadStats *stats);
+
+// Write the recent scheduler events to path as Chrome trace-event JSON
+int MyThreadTraceDump(const char *path);
+
+// ****** CALLS FROM OTHER KERNEL THREADS ******
+// Safe from any kernel thread, e.g. a library's completion callback, while
+// MyThreadInit runs. Hold keeps it from returning until Release.
+void MyThreadExternalHold(void);
+void MyThreadExternalRelease(void);
+int MySemaphoreSignalExternal(MySemaphore sem);
+MyThread MyThreadCreateExternal(void(*start_funct)(void *), void *args);
+
+// ****** COROUTINE SUPPORT ******
+// For stackless coroutine frontends, see mythread_coro.h
+// A scheduler entry that runs by calling resume(arg) on the worker's stack
+MyThread MyCoroutineCreate(void(*resume)(void *), void *arg);
+
+// The library call the invoking coroutine just made has parked it, suspend now
+int MyCoroutineParked(void);
+
 // ****** CALLS ONLY FOR UNIX PROCESS ****** 
+// Choose the scheduling policy, before MyThreadInit
+int MyThreadSetPolicy(int policy);
+
+// Preempt threads running longer than quantum_ns, before MyThreadInit (0: cooperative)
+void MyThreadSetQuantum(unsigned long long quantum_ns);
+
 // Create and run the "main" thread
 void MyThreadInit(void(*start_funct)(void *), void *args);
 
+// Same, but run MyThreads on a pool of n kernel threads (n <= 0: one per CPU)
+void MyThreadInitWorkers(void(*start_funct)(void *), void *args, int n);
+
 #endif /* MYTHREAD_H */
 /*........................ end of mythread.h ................................*/
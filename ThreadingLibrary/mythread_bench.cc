@@ -0,0 +1,474 @@
+/******************************************************************************
+ *
+ *  File Name........: mythread_bench.cc
+ *
+ *  Description......: Microbenchmarks for mythread.a, with the same cases
+ *                     run on pthreads for comparison. Built by make bench.
+ *
+ *  Usage............: mythread_bench [-c] [-p] [-w workers] [-r reps]
+ *                                    [-n threads] [case ...]
+ *                     -c  CSV instead of a table
+ *                     -p  also run the pthread baseline
+ *
+ *****************************************************************************/
+
+#include "mythread.h"
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+#define PTHREAD_STACK (64 * 1024) // same as a MyThread's default
+
+static int reps = 10; // timed batches per case, the percentiles are of their means
+static int nthreads = 10000; // threads per batch in the create/join/memory cases
+static int pingpongs = 100000; // round trips per batch in the ping-pong cases
+static int tree_depth = 13; // 2^13 - 1 threads per tree
+static bool csv = false;
+
+static uint64_t _nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long _rssBytes()
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f)
+	{
+		if(fscanf(f, "%*d %ld", &pages) != 1) pages = 0;
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+// ****** REPORTING ******
+
+// Timed batches of one case, mean ns per op in each
+typedef struct {
+	std::vector<double> batch_ns;
+	uint64_t total_ns;
+	long total_ops;
+} Samples;
+
+static void _record(Samples *s, uint64_t ns, long ops)
+{
+	s->batch_ns.push_back((double)ns / ops);
+	s->total_ns += ns;
+	s->total_ops += ops;
+}
+
+static double _percentile(std::vector<double> v, double p)
+{
+	if(v.empty()) return 0;
+	std::sort(v.begin(), v.end());
+	size_t i = (size_t)(p / 100 * (v.size() - 1) + 0.5);
+	return v[i];
+}
+
+static void _header()
+{
+	if(csv) printf("impl,case,unit,ops,value,ops_per_s,batch_p50,batch_p90,batch_p99\n");
+	else printf("%-8s %-16s %12s %12s %14s %10s %10s %10s\n",
+			"impl", "case", "ops", "ns/op", "ops/s", "batch_p50", "batch_p90", "batch_p99");
+}
+
+static void _report(const char *impl, const char *name, Samples *s)
+{
+	double ns = (double)s->total_ns / s->total_ops;
+	double rate = 1e9 / ns;
+	double p50 = _percentile(s->batch_ns, 50), p90 = _percentile(s->batch_ns, 90), p99 = _percentile(s->batch_ns, 99);
+	if(csv) printf("%s,%s,ns/op,%ld,%.1f,%.0f,%.1f,%.1f,%.1f\n", impl, name, s->total_ops, ns, rate, p50, p90, p99);
+	else printf("%-8s %-16s %12ld %12.1f %14.0f %10.1f %10.1f %10.1f\n", impl, name, s->total_ops, ns, rate, p50, p90, p99);
+	fflush(stdout);
+}
+
+static void _reportBytes(const char *impl, const char *name, long threads, double bytes)
+{
+	if(csv) printf("%s,%s,bytes/thread,%ld,%.0f,,,,\n", impl, name, threads, bytes);
+	else printf("%-8s %-16s %12ld %12.0f bytes/thread\n", impl, name, threads, bytes);
+	fflush(stdout);
+}
+
+// ****** MYTHREAD CASES ******
+
+static void _myExit(void *args)
+{
+	MyThreadExit();
+}
+
+static void myCreateExit(Samples *s)
+{
+	uint64_t t = _nowNs();
+	for(int i = 0; i < nthreads; i++) MyThreadCreate(_myExit, 0);
+	MyThreadJoinAll();
+	_record(s, _nowNs() - t, nthreads);
+}
+
+static void _myYielder(void *args)
+{
+	for(int i = 0; i < pingpongs; i++) MyThreadYield();
+	MyThreadExit();
+}
+
+static void myYieldPingPong(Samples *s)
+{
+	uint64_t t = _nowNs();
+	MyThreadCreate(_myYielder, 0);
+	MyThreadCreate(_myYielder, 0);
+	MyThreadJoinAll();
+	_record(s, _nowNs() - t, 2L * pingpongs); // one switch per yield
+}
+
+static MySemaphore my_ping, my_pong;
+
+static void _myPonger(void *args)
+{
+	for(int i = 0; i < pingpongs; i++)
+	{
+		MySemaphoreWait(my_ping);
+		MySemaphoreSignal(my_pong);
+	}
+	MyThreadExit();
+}
+
+static void mySemHandoff(Samples *s)
+{
+	my_ping = MySemaphoreInit(0);
+	my_pong = MySemaphoreInit(0);
+	MyThread child = MyThreadCreate(_myPonger, 0);
+	uint64_t t = _nowNs();
+	for(int i = 0; i < pingpongs; i++)
+	{
+		MySemaphoreSignal(my_ping);
+		MySemaphoreWait(my_pong);
+	}
+	_record(s, _nowNs() - t, 2L * pingpongs); // two handoffs per round trip
+	MyThreadJoin(child);
+	MySemaphoreDestroy(my_ping);
+	MySemaphoreDestroy(my_pong);
+}
+
+static void myJoinFanout(Samples *s)
+{
+	std::vector<MyThread> children(nthreads);
+	uint64_t t = _nowNs();
+	for(int i = 0; i < nthreads; i++) children[i] = MyThreadCreate(_myExit, 0);
+	for(int i = 0; i < nthreads; i++) MyThreadJoin(children[i]);
+	_record(s, _nowNs() - t, nthreads);
+}
+
+static void _myTree(void *args)
+{
+	long depth = (long)args;
+	if(depth > 1)
+	{
+		MyThreadCreate(_myTree, (void*)(depth - 1));
+		MyThreadCreate(_myTree, (void*)(depth - 1));
+		MyThreadJoinAll();
+	}
+	MyThreadExit();
+}
+
+static void myJoinAllTree(Samples *s)
+{
+	uint64_t t = _nowNs();
+	MyThreadCreate(_myTree, (void*)(long)tree_depth);
+	MyThreadJoinAll();
+	_record(s, _nowNs() - t, (1L << tree_depth) - 1);
+}
+
+static MySemaphore my_idle;
+
+static void _myIdler(void *args)
+{
+	MySemaphoreWait(my_idle);
+	MyThreadExit();
+}
+
+static double my_idle_bytes;
+
+// Runs in a process of its own, so the stacks and pools start out cold like a
+// pthread's and the pages the threads touch are counted
+static void _myIdleMain(void *args)
+{
+	my_idle = MySemaphoreInit(0);
+	long before = _rssBytes();
+	for(int i = 0; i < nthreads; i++) MyThreadCreate(_myIdler, 0);
+	MyThreadYield(); // let them all block
+	long after = _rssBytes();
+	for(int i = 0; i < nthreads; i++) MySemaphoreSignal(my_idle);
+	MyThreadJoinAll();
+	MySemaphoreDestroy(my_idle);
+	my_idle_bytes = (double)(after - before) / nthreads;
+	MyThreadExit();
+}
+
+static int idle_workers;
+
+static double myIdleMemory()
+{
+	MyThreadInitWorkers(_myIdleMain, 0, idle_workers);
+	return my_idle_bytes;
+}
+
+// ****** PTHREAD CASES ******
+
+static pthread_attr_t pt_attr;
+
+static void *_ptExit(void *args)
+{
+	return 0;
+}
+
+static void ptCreateExit(Samples *s)
+{
+	std::vector<pthread_t> tids(nthreads);
+	uint64_t t = _nowNs();
+	for(int i = 0; i < nthreads; i++) pthread_create(&tids[i], &pt_attr, _ptExit, 0);
+	for(int i = 0; i < nthreads; i++) pthread_join(tids[i], 0);
+	_record(s, _nowNs() - t, nthreads);
+}
+
+static void *_ptYielder(void *args)
+{
+	// both on one CPU, like two MyThreads on one worker
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	for(int i = 0; i < pingpongs; i++) sched_yield();
+	return 0;
+}
+
+static void ptYieldPingPong(Samples *s)
+{
+	pthread_t a, b;
+	uint64_t t = _nowNs();
+	pthread_create(&a, &pt_attr, _ptYielder, 0);
+	pthread_create(&b, &pt_attr, _ptYielder, 0);
+	pthread_join(a, 0);
+	pthread_join(b, 0);
+	_record(s, _nowNs() - t, 2L * pingpongs);
+}
+
+static sem_t pt_ping, pt_pong;
+
+static void *_ptPonger(void *args)
+{
+	for(int i = 0; i < pingpongs; i++)
+	{
+		sem_wait(&pt_ping);
+		sem_post(&pt_pong);
+	}
+	return 0;
+}
+
+static void ptSemHandoff(Samples *s)
+{
+	sem_init(&pt_ping, 0, 0);
+	sem_init(&pt_pong, 0, 0);
+	pthread_t child;
+	pthread_create(&child, &pt_attr, _ptPonger, 0);
+	uint64_t t = _nowNs();
+	for(int i = 0; i < pingpongs; i++)
+	{
+		sem_post(&pt_ping);
+		sem_wait(&pt_pong);
+	}
+	_record(s, _nowNs() - t, 2L * pingpongs);
+	pthread_join(child, 0);
+	sem_destroy(&pt_ping);
+	sem_destroy(&pt_pong);
+}
+
+// pthreads have no JoinAll, so fan-out and create+exit are the same thing
+static void ptJoinFanout(Samples *s)
+{
+	ptCreateExit(s);
+}
+
+static void *_ptTree(void *args)
+{
+	long depth = (long)args;
+	if(depth > 1)
+	{
+		pthread_t a, b;
+		pthread_create(&a, &pt_attr, _ptTree, (void*)(depth - 1));
+		pthread_create(&b, &pt_attr, _ptTree, (void*)(depth - 1));
+		pthread_join(a, 0);
+		pthread_join(b, 0);
+	}
+	return 0;
+}
+
+static void ptJoinAllTree(Samples *s)
+{
+	uint64_t t = _nowNs();
+	_ptTree((void*)(long)tree_depth);
+	_record(s, _nowNs() - t, (1L << tree_depth) - 1);
+}
+
+static pthread_mutex_t pt_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pt_idle_cond = PTHREAD_COND_INITIALIZER;
+static int pt_idle_count;
+static bool pt_idle_go;
+
+static void *_ptIdler(void *args)
+{
+	pthread_mutex_lock(&pt_idle_lock);
+	pt_idle_count++;
+	pthread_cond_broadcast(&pt_idle_cond);
+	while(!pt_idle_go) pthread_cond_wait(&pt_idle_cond, &pt_idle_lock);
+	pthread_mutex_unlock(&pt_idle_lock);
+	return 0;
+}
+
+static double ptIdleMemory()
+{
+	std::vector<pthread_t> tids(nthreads);
+	pt_idle_count = 0;
+	pt_idle_go = false;
+	long before = _rssBytes();
+	for(int i = 0; i < nthreads; i++) pthread_create(&tids[i], &pt_attr, _ptIdler, 0);
+	pthread_mutex_lock(&pt_idle_lock);
+	while(pt_idle_count < nthreads) pthread_cond_wait(&pt_idle_cond, &pt_idle_lock);
+	long after = _rssBytes();
+	pt_idle_go = true;
+	pthread_cond_broadcast(&pt_idle_cond);
+	pthread_mutex_unlock(&pt_idle_lock);
+	for(int i = 0; i < nthreads; i++) pthread_join(tids[i], 0);
+	return (double)(after - before) / nthreads;
+}
+
+// ****** DRIVER ******
+
+// Run fn in a fresh process, which has not touched any memory for threads yet
+static double _inChild(double (*fn)())
+{
+	int fds[2];
+	double bytes = 0;
+	if(pipe(fds) != 0) return 0;
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		bytes = fn();
+		if(write(fds[1], &bytes, sizeof(bytes)) != sizeof(bytes)) _exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	if(pid < 0 || read(fds[0], &bytes, sizeof(bytes)) != sizeof(bytes)) bytes = 0;
+	close(fds[0]);
+	if(pid > 0) waitpid(pid, 0, 0);
+	return bytes;
+}
+
+typedef struct {
+	const char *name;
+	void (*my)(Samples *s);
+	void (*pt)(Samples *s);
+} Case;
+
+static const Case cases[] = {
+	{ "create_exit", myCreateExit, ptCreateExit },
+	{ "yield_pingpong", myYieldPingPong, ptYieldPingPong },
+	{ "sem_handoff", mySemHandoff, ptSemHandoff },
+	{ "join_fanout", myJoinFanout, ptJoinFanout },
+	{ "joinall_tree", myJoinAllTree, ptJoinAllTree },
+};
+#define NCASES (int)(sizeof(cases) / sizeof(cases[0]))
+#define MEMORY_CASE "idle_memory"
+
+static char **selected;
+static int nselected;
+
+static bool _wanted(const char *name)
+{
+	if(nselected == 0) return true;
+	for(int i = 0; i < nselected; i++)
+	{
+		if(strcmp(selected[i], name) == 0) return true;
+	}
+	return false;
+}
+
+static void _runCase(const char *impl, const Case *c, void (*fn)(Samples *s))
+{
+	Samples warmup = Samples(), s = Samples();
+	fn(&warmup); // fault in stacks and pools first
+	for(int r = 0; r < reps; r++) fn(&s);
+	_report(impl, c->name, &s);
+}
+
+static void _myMain(void *args)
+{
+	for(int i = 0; i < NCASES; i++)
+	{
+		if(_wanted(cases[i].name)) _runCase("mythread", &cases[i], cases[i].my);
+	}
+	MyThreadExit();
+}
+
+static void _usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c] [-p] [-w workers] [-r reps] [-n threads] [case ...]\n", prog);
+	fprintf(stderr, "cases:");
+	for(int i = 0; i < NCASES; i++) fprintf(stderr, " %s", cases[i].name);
+	fprintf(stderr, " %s\n", MEMORY_CASE);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int nworkers = 1;
+	bool baseline = false;
+	int opt;
+	while((opt = getopt(argc, argv, "cpw:r:n:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 'c': csv = true; break;
+		case 'p': baseline = true; break;
+		case 'w': nworkers = atoi(optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		case 'n': nthreads = atoi(optarg); break;
+		default: _usage(argv[0]);
+		}
+	}
+	if(reps < 1 || nthreads < 1) _usage(argv[0]);
+	selected = argv + optind;
+	nselected = argc - optind;
+
+	pthread_attr_init(&pt_attr);
+	pthread_attr_setstacksize(&pt_attr, PTHREAD_STACK);
+	idle_workers = nworkers;
+	// before this process creates any thread itself
+	bool memory = _wanted(MEMORY_CASE);
+	double my_bytes = memory? _inChild(myIdleMemory) : 0;
+	double pt_bytes = memory && baseline? _inChild(ptIdleMemory) : 0;
+
+	_header();
+	MyThreadInitWorkers(_myMain, 0, nworkers);
+	if(memory) _reportBytes("mythread", MEMORY_CASE, nthreads, my_bytes);
+
+	if(baseline)
+	{
+		for(int i = 0; i < NCASES; i++)
+		{
+			if(_wanted(cases[i].name)) _runCase("pthread", &cases[i], cases[i].pt);
+		}
+		if(memory) _reportBytes("pthread", MEMORY_CASE, nthreads, pt_bytes);
+	}
+	return 0;
+}
@@ -0,0 +1,507 @@
+#include "mythread_impl.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SELECT_LOCAL 8 // select cases whose waiters fit on the stack
+
+// A channel is a ring buffer of capacity items plus queues of the threads
+// blocked sending and receiving, all under one lock. A thread that blocks
+// leaves a waiter on its own stack pointing at its items, and whoever comes
+// along copies straight from or into them: a blocked receiver finds the
+// value already in place when it wakes, and it is run next on the waker's
+// worker instead of going to the back of the ready queue.
+//
+// A thread in MyChannelSelect has a waiter on every channel it waits for.
+// The first one to move its item claims the thread (the same wait_state CAS
+// as timed waits), the others are skipped and pruned. Such a thread parks
+// holding its own lock, so it is woken only after the channel lock is
+// dropped and its lock taken, never while still queueing itself elsewhere.
+
+typedef struct _MyChanWaiter _MyChanWaiter;
+typedef struct _MySelect _MySelect;
+
+struct _MyChanWaiter {
+	_MyChanWaiter *next;
+	_MyChanWaiter *prev;
+	_MyChanWaiter *wake_next; // on the list of waiters to wake once the lock is dropped
+	_MyThread *thread;
+	char *elems; // items to send or room to receive into
+	size_t n; // items wanted
+	size_t done; // items moved so far
+	_MySelect *sel; // 0 unless the thread waits in MyChannelSelect
+	int index; // its case
+	bool queued;
+};
+
+struct _MySelect {
+	int fired; // case that went through
+};
+
+typedef struct {
+	_MyChanWaiter *head;
+	_MyChanWaiter *tail;
+} _MyChanQueue;
+
+typedef struct {
+	_MyLock lock;
+	size_t elem_size;
+	size_t cap;
+	size_t head; // oldest buffered item
+	size_t count; // buffered items
+	bool closed;
+	_MyChanQueue senders; // only while the buffer is full
+	_MyChanQueue receivers; // only while the buffer is empty
+	char *buf;
+} _MyChan;
+
+static void _cqPush(_MyChanQueue *q, _MyChanWaiter *wt)
+{
+	wt->next = 0;
+	wt->prev = q->tail;
+	if(q->tail) q->tail->next = wt;
+	else q->head = wt;
+	q->tail = wt;
+	wt->queued = true;
+}
+
+static void _cqRemove(_MyChanQueue *q, _MyChanWaiter *wt)
+{
+	if(wt->prev) wt->prev->next = wt->next;
+	else q->head = wt->next;
+	if(wt->next) wt->next->prev = wt->prev;
+	else q->tail = wt->prev;
+	wt->queued = false;
+}
+
+// First waiter in q that can take part in a transfer, which the caller is
+// about to make: a select waiter is claimed right here. Waiters of self (a
+// select with both directions on one channel) are skipped, those claimed
+// elsewhere dropped.
+static _MyChanWaiter *_cqFront(_MyChanQueue *q, _MyThread *self)
+{
+	_MyChanWaiter *wt = q->head;
+	while(wt)
+	{
+		_MyChanWaiter *next = wt->next;
+		if(wt->thread == self)
+		{
+			wt = next;
+			continue;
+		}
+		if(!wt->sel) return wt;
+		if(_waitClaim(wt->thread))
+		{
+			wt->sel->fired = wt->index;
+			return wt;
+		}
+		_cqRemove(q, wt);
+		wt = next;
+	}
+	return 0;
+}
+
+// Whether q has a waiter _cqFront would return, without claiming it
+static bool _cqReady(_MyChanQueue *q, _MyThread *self)
+{
+	for(_MyChanWaiter *wt = q->head; wt; wt = wt->next)
+	{
+		if(wt->thread == self) continue;
+		if(!wt->sel || wt->thread->wait_state.load() == WAIT_BLOCKED) return true;
+	}
+	return false;
+}
+
+static void _ringPut(_MyChan *ch, const char *src, size_t k)
+{
+	size_t es = ch->elem_size;
+	size_t tail = (ch->head + ch->count) % ch->cap;
+	size_t first = k < ch->cap - tail? k : ch->cap - tail;
+	memcpy(ch->buf + tail * es, src, first * es);
+	memcpy(ch->buf, src + first * es, (k - first) * es);
+	ch->count += k;
+}
+
+static void _ringGet(_MyChan *ch, char *dst, size_t k)
+{
+	size_t es = ch->elem_size;
+	size_t first = k < ch->cap - ch->head? k : ch->cap - ch->head;
+	memcpy(dst, ch->buf + ch->head * es, first * es);
+	memcpy(dst + first * es, ch->buf, (k - first) * es);
+	ch->head = (ch->head + k) % ch->cap;
+	ch->count -= k;
+}
+
+static inline size_t _min(size_t a, size_t b)
+{
+	return a < b? a : b;
+}
+
+// Move up to n items from src to waiting receivers, then into the buffer.
+// Satisfied receivers go on *wake. ch->lock held.
+static size_t _chanPut(_MyChan *ch, const char *src, size_t n, _MyThread *self, _MyChanWaiter **wake)
+{
+	size_t es = ch->elem_size;
+	size_t moved = 0;
+	_MyChanWaiter *r;
+	while(moved < n && ch->count == 0 && (r = _cqFront(&ch->receivers, self)))
+	{ // any receiver is content with what it gets
+		size_t k = _min(n - moved, r->n - r->done);
+		memcpy(r->elems + r->done * es, src + moved * es, k * es);
+		r->done += k;
+		moved += k;
+		_cqRemove(&ch->receivers, r);
+		r->wake_next = *wake;
+		*wake = r;
+	}
+	if(moved < n && ch->count < ch->cap)
+	{
+		size_t k = _min(n - moved, ch->cap - ch->count);
+		_ringPut(ch, src + moved * es, k);
+		moved += k;
+	}
+	return moved;
+}
+
+// Move up to n items to dst from the buffer, refilling it from waiting
+// senders, or straight from them if there is no buffer. Senders that are
+// done go on *wake. ch->lock held.
+static size_t _chanGet(_MyChan *ch, char *dst, size_t n, _MyThread *self, _MyChanWaiter **wake)
+{
+	size_t es = ch->elem_size;
+	size_t moved = _min(n, ch->count);
+	if(moved) _ringGet(ch, dst, moved);
+
+	while(moved < n || ch->count < ch->cap)
+	{
+		_MyChanWaiter *s = _cqFront(&ch->senders, self);
+		if(!s) break;
+		size_t left = s->n - s->done;
+		if(moved < n)
+		{ // the buffer is empty, take from the sender directly
+			size_t k = _min(n - moved, left);
+			memcpy(dst + moved * es, s->elems + s->done * es, k * es);
+			s->done += k;
+			moved += k;
+		}
+		else
+		{
+			size_t k = _min(ch->cap - ch->count, left);
+			_ringPut(ch, s->elems + s->done * es, k);
+			s->done += k;
+		}
+		if(s->done < s->n) break;
+		_cqRemove(&ch->senders, s);
+		s->wake_next = *wake;
+		*wake = s;
+	}
+	return moved;
+}
+
+// Wake the waiters collected by _chanPut/_chanGet/MyChannelClose, ch->lock released
+static void _chanWake(_MyChanWaiter *wake)
+{
+	bool single = wake && !wake->wake_next;
+	while(wake)
+	{
+		_MyChanWaiter *wt = wake;
+		wake = wt->wake_next; // wt goes away once its thread runs
+		_MyThread *t = wt->thread;
+		if(wt->sel)
+		{ // parked with its own lock, which it may not have got to yet
+			_lock(&t->lock);
+			_unlock(&t->lock);
+		}
+		if(single) _wakeNext(t);
+		else _wake(t);
+	}
+}
+
+/*
+ * Create a channel of items of elem_size bytes that buffers up to capacity
+ * of them. With capacity 0 every send waits for a receiver to take the item.
+ * Returns 0 if out of memory.
+ */
+MyChannel MyChannelCreate(size_t elem_size, size_t capacity)
+{
+	_MyChan *ch = new _MyChan();
+	ch->elem_size = elem_size;
+	ch->cap = capacity;
+	if(capacity)
+	{
+		ch->buf = (char*)malloc(elem_size * capacity);
+		if(!ch->buf && elem_size)
+		{
+			delete ch;
+			return 0;
+		}
+	}
+	return (MyChannel)ch;
+}
+
+/*
+ * Send the n items at elems, blocking while the channel is full. Items go
+ * to waiting receivers directly. Returns the number of items sent, which is
+ * less than n only if the channel is closed.
+ */
+size_t MyChannelSendMany(MyChannel channel, const void *elems, size_t n)
+{
+	_MyNoPreempt np;
+	_MyChan *ch = (_MyChan*)channel;
+	_MyThread *self = _worker()->current;
+	size_t moved = 0;
+	while(true)
+	{
+		_lock(&ch->lock);
+		if(ch->closed)
+		{
+			_unlock(&ch->lock);
+			return moved;
+		}
+		_MyChanWaiter *wake = 0;
+		moved += _chanPut(ch, (const char*)elems + moved * ch->elem_size, n - moved, self, &wake);
+		if(moved == n || wake)
+		{ // the receivers have to be woken before we may park
+			_unlock(&ch->lock);
+			_chanWake(wake);
+			if(moved == n) return n;
+			continue;
+		}
+
+		// receivers take the rest from here
+		_MyChanWaiter wt;
+		wt.thread = self;
+		wt.elems = (char*)elems;
+		wt.n = n;
+		wt.done = moved;
+		wt.sel = 0;
+		_cqPush(&ch->senders, &wt);
+		_popNextThread(&ch->lock);
+		return wt.done;
+	}
+}
+
+/*
+ * Receive up to n items into elems, blocking until there is at least one.
+ * Returns the number of items received, 0 once the channel is closed and empty.
+ */
+size_t MyChannelRecvMany(MyChannel channel, void *elems, size_t n)
+{
+	_MyNoPreempt np;
+	_MyChan *ch = (_MyChan*)channel;
+	if(n == 0) return 0;
+	_lock(&ch->lock);
+	_MyChanWaiter *wake = 0;
+	size_t moved = _chanGet(ch, (char*)elems, n, _worker()->current, &wake);
+	if(moved || ch->closed)
+	{
+		_unlock(&ch->lock);
+		_chanWake(wake);
+		return moved;
+	}
+
+	// nothing was moved, so nobody needs waking; a sender fills in elems
+	_MyChanWaiter wt;
+	wt.thread = _worker()->current;
+	wt.elems = (char*)elems;
+	wt.n = n;
+	wt.done = 0;
+	wt.sel = 0;
+	_cqPush(&ch->receivers, &wt);
+	_popNextThread(&ch->lock);
+	return wt.done;
+}
+
+/*
+ * Send the item at elem. Returns 0 on success, -1 if the channel is closed.
+ */
+int MyChannelSend(MyChannel channel, const void *elem)
+{
+	return MyChannelSendMany(channel, elem, 1) == 1? 0 : -1;
+}
+
+/*
+ * Receive an item into elem. Returns 0 on success, -1 if the channel is
+ * closed and empty.
+ */
+int MyChannelRecv(MyChannel channel, void *elem)
+{
+	return MyChannelRecvMany(channel, elem, 1) == 1? 0 : -1;
+}
+
+// Try one case, ch->lock held. Returns whether it went through.
+static bool _selectTry(_MyChan *ch, MyChannelCase *c, _MyThread *self, _MyChanWaiter **wake)
+{
+	if(c->send)
+	{
+		c->closed = ch->closed;
+		return ch->closed || _chanPut(ch, (const char*)c->elem, 1, self, wake) == 1;
+	}
+	if(_chanGet(ch, (char*)c->elem, 1, self, wake) == 1)
+	{
+		c->closed = 0;
+		return true;
+	}
+	if(!ch->closed) return false;
+	memset(c->elem, 0, ch->elem_size);
+	c->closed = 1;
+	return true;
+}
+
+// Whether a case would go through, ch->lock held
+static bool _selectReady(_MyChan *ch, MyChannelCase *c, _MyThread *self)
+{
+	if(ch->closed) return true;
+	if(c->send) return ch->count < ch->cap || (ch->count == 0 && _cqReady(&ch->receivers, self));
+	return ch->count > 0 || _cqReady(&ch->senders, self);
+}
+
+/*
+ * Wait until one of the n cases can go through and carry it out: send
+ * *elem on channel, or receive into elem. Cases with a 0 channel are
+ * ignored. Returns the index of that case; if its channel is closed,
+ * its closed field is set (and a receive gets zeros), otherwise cleared.
+ * If several cases are ready one is picked at random. With block = 0,
+ * returns -1 at once if none is ready; -1 also if all channels are 0.
+ */
+int MyChannelSelect(MyChannelCase *cases, int n, int block)
+{
+	_MyNoPreempt np;
+	_MyWorker *w = _worker();
+	_MyThread *self = w->current;
+	int start = n > 0? rand_r(&w->seed) % n : 0;
+
+	// first see if anything is ready
+	for(int j = 0; j < n; j++)
+	{
+		int i = (start + j) % n;
+		_MyChan *ch = (_MyChan*)cases[i].channel;
+		if(!ch) continue;
+		_MyChanWaiter *wake = 0;
+		_lock(&ch->lock);
+		bool fired = _selectTry(ch, &cases[i], self, &wake);
+		_unlock(&ch->lock);
+		_chanWake(wake);
+		if(fired) return i;
+	}
+	if(!block) return -1;
+
+	_MyChanWaiter local[SELECT_LOCAL];
+	_MyChanWaiter *nodes = n <= SELECT_LOCAL? local : new _MyChanWaiter[n];
+	_MySelect sel;
+	int result = -2;
+	while(result == -2)
+	{
+		// queue a waiter on every channel, unless one has become ready meanwhile
+		sel.fired = -1;
+		for(int i = 0; i < n; i++) nodes[i].queued = false;
+		_MyChanWaiter *wake = 0;
+		bool waiting = false; // something to wait for
+		bool claimed = false; // by us: sel.fired went through or we start over
+		_lock(&self->lock);
+		self->wait_state.store(WAIT_BLOCKED);
+		for(int j = 0; j < n; j++)
+		{
+			int i = (start + j) % n;
+			_MyChan *ch = (_MyChan*)cases[i].channel;
+			if(!ch) continue;
+			waiting = true;
+			_lock(&ch->lock);
+			if(_selectReady(ch, &cases[i], self))
+			{ // whoever claims us first carries out their case, the other one backs off
+				if(_waitClaim(self))
+				{
+					claimed = true;
+					// fails only if the counterpart was claimed elsewhere just now
+					if(_selectTry(ch, &cases[i], self, &wake)) sel.fired = i;
+				}
+				_unlock(&ch->lock);
+				break;
+			}
+			_MyChanWaiter *wt = &nodes[i];
+			wt->thread = self;
+			wt->elems = (char*)cases[i].elem;
+			wt->n = 1;
+			wt->done = 0;
+			wt->sel = &sel;
+			wt->index = i;
+			_cqPush(cases[i].send? &ch->senders : &ch->receivers, wt);
+			_unlock(&ch->lock);
+		}
+		if(!waiting)
+		{
+			_unlock(&self->lock);
+			result = -1;
+			break;
+		}
+		if(claimed) _unlock(&self->lock);
+		else _popNextThread(&self->lock); // the claimer wakes us
+		_chanWake(wake);
+
+		// take down the waiters that did not fire
+		for(int i = 0; i < n; i++)
+		{
+			_MyChan *ch = (_MyChan*)cases[i].channel;
+			if(!nodes[i].queued) continue;
+			_lock(&ch->lock);
+			if(nodes[i].queued) _cqRemove(cases[i].send? &ch->senders : &ch->receivers, &nodes[i]);
+			_unlock(&ch->lock);
+		}
+		if(sel.fired >= 0)
+		{
+			result = sel.fired;
+			MyChannelCase *c = &cases[result];
+			if(!claimed)
+			{ // carried out by the claimer, or cut short by MyChannelClose
+				c->closed = nodes[result].done == 0;
+				if(c->closed && !c->send) memset(c->elem, 0, ((_MyChan*)c->channel)->elem_size);
+			}
+		}
+	}
+	if(nodes != local) delete[] nodes;
+	return result;
+}
+
+/*
+ * Close the channel: sends fail from now on, receives get what is still
+ * buffered and then fail. Blocked senders and receivers return.
+ */
+void MyChannelClose(MyChannel channel)
+{
+	_MyNoPreempt np;
+	_MyChan *ch = (_MyChan*)channel;
+	_lock(&ch->lock);
+	ch->closed = true;
+	_MyChanWaiter *wake = 0;
+	_MyChanQueue *queues[2] = { &ch->senders, &ch->receivers };
+	for(int q = 0; q < 2; q++)
+	{
+		_MyChanWaiter *wt;
+		while((wt = _cqFront(queues[q], 0)))
+		{
+			_cqRemove(queues[q], wt);
+			wt->wake_next = wake;
+			wake = wt;
+		}
+	}
+	_unlock(&ch->lock);
+	_chanWake(wake);
+}
+
+/*
+ * Destroy the channel. Returns -1 if threads are blocked on it, 0 on success.
+ */
+int MyChannelDestroy(MyChannel channel)
+{
+	_MyNoPreempt np;
+	_MyChan *ch = (_MyChan*)channel;
+	if(!ch) return -1;
+	_lock(&ch->lock);
+	if(ch->senders.head || ch->receivers.head)
+	{
+		_unlock(&ch->lock);
+		return -1;
+	}
+	free(ch->buf);
+	delete ch;
+	return 0;
+}
@@ -0,0 +1,251 @@
+/******************************************************************************
+ *
+ *  File Name........: mythread_coro.h
+ *
+ *  Description......: Stackless C++20 coroutines on the MyThread scheduler.
+ *                     Header only, compile with -std=c++20.
+ *
+ *****************************************************************************/
+
+#ifndef MYTHREAD_CORO_H
+#define MYTHREAD_CORO_H
+
+#include "mythread.h"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <errno.h>
+#include <unistd.h>
+
+// A MyTask<T> is a coroutine returning T that starts when first awaited.
+// Awaiting it from another task runs it right there and resumes the awaiting
+// task once it is done, without going through the scheduler. MyTaskSpawn
+// hands a task to the scheduler as an entry of its own, a child of the
+// invoking thread that MyThreadJoin waits for like any other.
+//
+// Spawned tasks block through the awaitables below, which park the entry on
+// the same wait queues stackful threads use, so threads and tasks can wait
+// on the same semaphore. A task's memory is its coroutine frame, plus a
+// control block for a spawned one, and never a stack. Tasks are not
+// preempted, and any other blocking call blocks the whole worker.
+
+template<class T> class MyTask;
+
+// The scheduler entry of a spawned task
+typedef struct {
+	std::coroutine_handle<> resume; // the innermost task, resumed when the entry runs
+} _MyCoEntry;
+
+inline void _myCoResume(void *arg)
+{
+	((_MyCoEntry*)arg)->resume.resume();
+}
+
+struct _MyCoPromise {
+	_MyCoEntry *entry = 0; // of the spawned task this one runs under
+	std::coroutine_handle<> continuation; // the awaiting task, none for a spawned one
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		template<class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			_MyCoPromise &p = h.promise();
+			if(p.continuation) return p.continuation;
+			// a spawned task is done, and so is its entry
+			if(p.exception) std::terminate(); // like an exception leaving a thread's start function
+			_MyCoEntry *e = p.entry;
+			h.destroy();
+			delete e;
+			MyThreadExit();
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<class T>
+struct _MyCoValue : _MyCoPromise {
+	std::optional<T> value;
+
+	void return_value(T v) { value.emplace(std::move(v)); }
+
+	T result()
+	{
+		if(exception) std::rethrow_exception(exception);
+		return std::move(*value);
+	}
+};
+
+template<>
+struct _MyCoValue<void> : _MyCoPromise {
+	void return_void() {}
+
+	void result()
+	{
+		if(exception) std::rethrow_exception(exception);
+	}
+};
+
+template<class T = void>
+class MyTask {
+public:
+	struct promise_type : _MyCoValue<T> {
+		MyTask get_return_object() { return MyTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+	};
+
+	MyTask(MyTask &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+	MyTask(const MyTask &) = delete;
+	MyTask &operator=(const MyTask &) = delete;
+
+	~MyTask()
+	{
+		if(handle) handle.destroy();
+	}
+
+	// Runs the task in the awaiting one, which it must be called from
+	struct Awaiter {
+		std::coroutine_handle<promise_type> task;
+
+		bool await_ready() noexcept { return false; }
+
+		template<class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> caller) noexcept
+		{
+			task.promise().entry = caller.promise().entry;
+			task.promise().continuation = caller;
+			return task;
+		}
+
+		T await_resume() { return task.promise().result(); }
+	};
+
+	Awaiter operator co_await() noexcept { return Awaiter{handle}; }
+
+private:
+	explicit MyTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+	template<class U> friend MyThread MyTaskSpawn(MyTask<U> task);
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/*
+ * Starts task as a scheduler entry of its own, a child of the invoking thread.
+ * Its result is dropped and its frame freed once it is done; an exception
+ * leaving it terminates the process. Join it with MyThreadJoin.
+ */
+template<class T>
+MyThread MyTaskSpawn(MyTask<T> task)
+{
+	auto h = std::exchange(task.handle, {});
+	_MyCoEntry *e = new _MyCoEntry();
+	e->resume = h;
+	h.promise().entry = e;
+	return MyCoroutineCreate(_myCoResume, e);
+}
+
+// Makes a blocking library call for the awaiting task, which suspends if the
+// call has parked its entry. The result is the call's, known before parking.
+template<class F>
+struct _MyCoCall {
+	F call;
+	int result;
+
+	bool await_ready() noexcept { return false; }
+
+	template<class P>
+	bool await_suspend(std::coroutine_handle<P> h)
+	{
+		h.promise().entry->resume = h;
+		result = call();
+		return MyCoroutineParked();
+	}
+
+	int await_resume() noexcept { return result; }
+};
+
+template<class F>
+inline _MyCoCall<F> _myCoCall(F call)
+{
+	return _MyCoCall<F>{call, 0};
+}
+
+// Same as MyThreadYield
+inline auto MyCoYield()
+{
+	return _myCoCall([] { MyThreadYield(); return 0; });
+}
+
+// Same as MySemaphoreWait
+inline auto MyCoWait(MySemaphore sem)
+{
+	return _myCoCall([sem] { MySemaphoreWait(sem); return 0; });
+}
+
+// Same as MyThreadJoin, the result is 0 or -1
+inline auto MyCoJoin(MyThread thread)
+{
+	return _myCoCall([thread] { return MyThreadJoin(thread); });
+}
+
+// Same as MyThreadJoinAll
+inline auto MyCoJoinAll()
+{
+	return _myCoCall([] { MyThreadJoinAll(); return 0; });
+}
+
+// Same as MyThreadSleep
+inline auto MyCoSleep(unsigned long long ns)
+{
+	return _myCoCall([ns] { MyThreadSleep(ns); return 0; });
+}
+
+// Same as MyThreadWaitFd, the result is 0 or -1
+inline auto MyCoWaitFd(int fd, int events)
+{
+	return _myCoCall([fd, events] { return MyThreadWaitFd(fd, events); });
+}
+
+// n, or -2 if the I/O that returned it would have blocked. Out of line since
+// errno is per kernel thread and a task may have moved to another one.
+inline __attribute__((noinline)) ssize_t _myCoAgain(ssize_t n)
+{
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)? -2 : n;
+}
+
+// Same as MyThreadRead
+inline MyTask<ssize_t> MyCoRead(int fd, void *buf, size_t count)
+{
+	MyThreadWaitFd(fd, 0); // non-blocking from here on
+	while(true)
+	{
+		ssize_t n = _myCoAgain(read(fd, buf, count));
+		if(n != -2) co_return n;
+		if(co_await MyCoWaitFd(fd, MYTHREAD_FD_READ) < 0) co_return -1;
+	}
+}
+
+// Same as MyThreadWrite
+inline MyTask<ssize_t> MyCoWrite(int fd, const void *buf, size_t count)
+{
+	MyThreadWaitFd(fd, 0);
+	while(true)
+	{
+		ssize_t n = _myCoAgain(write(fd, buf, count));
+		if(n != -2) co_return n;
+		if(co_await MyCoWaitFd(fd, MYTHREAD_FD_WRITE) < 0) co_return -1;
+	}
+}
+
+#endif /* MYTHREAD_CORO_H */
+/*...................... end of mythread_coro.h .............................*/
@@ -0,0 +1,400 @@
+/******************************************************************************
+ *
+ *  File Name........: mythread_impl.h
+ *
+ *  Description......: Internals shared by the mythread.a sources.
+ *                     Not part of the public interface.
+ *
+ *****************************************************************************/
+
+#ifndef MYTHREAD_IMPL_H
+#define MYTHREAD_IMPL_H
+
+#include "mythread.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+#define STACK_CLASSES 24 // stack mappings of 2^k pages
+#define LOCK_SPINS 100 // spins before a waiter gives the CPU to the holder
+#define WHEEL_BITS 6 // timing wheel levels have 2^WHEEL_BITS slots
+#define WHEEL_LEVELS 6
+
+// Scheduler tracing hooks, compiled out unless the Makefile has TRACE=yes
+#ifdef MYTHREAD_TRACE
+#define TRACE(...) __VA_ARGS__
+#else
+#define TRACE(...)
+#endif
+
+// test-and-set lock, only ever held for a handful of instructions
+typedef struct {
+	std::atomic<bool> held{false};
+} _MyLock;
+
+static inline void _cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+static inline bool _trylock(_MyLock *l)
+{
+	return !l->held.exchange(true, std::memory_order_acquire);
+}
+
+static inline void _lock(_MyLock *l)
+{
+	while(!_trylock(l))
+	{
+		// with more workers than CPUs the holder may not be running at all
+		for(int i = 0; l->held.load(std::memory_order_relaxed); i++)
+		{
+			if(i < LOCK_SPINS) _cpuRelax();
+			else sched_yield();
+		}
+	}
+}
+
+static inline void _unlock(_MyLock *l)
+{
+	l->held.store(false, std::memory_order_release);
+}
+
+// see the context switch backends in mythread.cc
+#ifdef MYTHREAD_CONTEXT_ASM
+typedef struct {
+	void *sp;
+} _MyContext;
+#else
+#include <ucontext.h>
+typedef ucontext_t _MyContext;
+#endif
+
+typedef struct _MyThread _MyThread;
+typedef struct _MyQueue _MyQueue;
+typedef struct _MyWheel _MyWheel;
+typedef struct _MyTraceRing _MyTraceRing;
+typedef struct _MyArena _MyArena;
+
+// a MyThreadSleep or timed wait, see mythread_timer.cc
+typedef struct _MyTimer _MyTimer;
+struct _MyTimer {
+	_MyTimer *next; // in a wheel slot
+	_MyTimer *prev;
+	uint64_t expires; // in ticks
+	_MyWheel *wheel; // the wheel it was armed on, 0 when not armed
+	bool queued; // still in a slot, neither expired nor cancelled
+	unsigned char level;
+	unsigned char slot;
+	_MyThread *thread;
+};
+
+// a thread's value for a key, see mythread_key.cc
+typedef struct {
+	MyThreadKey key; // the key the value was set for, 0 if none
+	void *value;
+} _MyKeyValue;
+
+// how a blocked thread was woken, see _waitClaim
+enum { WAIT_BLOCKED = 1, WAIT_SIGNALED, WAIT_TIMEDOUT };
+
+struct _MyThread {
+	_MyContext context;
+	void *stack; // lowest usable address, the guard page sits right below
+	int stack_class;
+	_MyArena *arena; // stack and control block come from a MyThreadCreateMany arena, 0 if not
+	bool context_pending; // context to be made when the thread first runs, see _arenaContext
+	bool coroutine; // a stackless coroutine, run by _runCoroutines on the worker's stack
+	void(*start_funct)(void *);
+	void *args;
+
+	// link in the one ready queue or wait queue the thread is on
+	_MyThread *next;
+	_MyThread *prev;
+
+	// family, all guarded by the parent's lock except our own children list,
+	// joining and exited, which our lock guards
+	_MyLock lock;
+	_MyThread *parent;
+	_MyThread *first_child;
+	_MyThread *sibling_next;
+	_MyThread *sibling_prev;
+	_MyThread *joining; // the child we wait for, JOIN_ALL, or 0
+	bool exited; // the control block outlives the thread until its last child exits
+
+	// blocking on a semaphore or sleeping, a timeout and a wakeup race for wait_state
+	std::atomic<int> wait_state;
+	_MyLock *wait_lock; // held while parking, taken by a timeout before waking us
+	_MyQueue *wait_queue; // where a timeout has to dequeue us from, 0 if nowhere
+	_MyTimer timer;
+
+	// scheduling, see the policies in mythread.cc
+	int priority;
+	int level; // MLFQ level while epoch is current, priority otherwise
+	unsigned int epoch; // MLFQ boost period
+	uint64_t used; // ns run at level
+
+	// preemption, see mythread_preempt.cc
+	int preempt_off; // > 0 in library code and MyThreadPreemptDisable sections
+	bool preempt_pending; // the quantum ran out while preempt_off > 0
+
+#ifdef MYTHREAD_TRACE
+	// tracing, see mythread_trace.cc
+	unsigned int id;
+	int trace_state; // running, ready or blocked since trace_since
+	uint64_t trace_since;
+	uint64_t trace_waited; // in the ready queue before the current run
+	MyThreadStats stats;
+#endif
+
+	// thread-specific data, see mythread_key.cc
+	bool has_specific; // a value has been set, all zero otherwise
+	_MyKeyValue specific[MYTHREAD_KEYS_MAX];
+};
+
+#define JOIN_ALL ((_MyThread*)1)
+
+// intrusive FIFO of threads, linked through _MyThread.next/prev
+struct _MyQueue {
+	_MyThread *head;
+	_MyThread *tail;
+};
+
+static inline void _qPush(_MyQueue *q, _MyThread *t)
+{
+	t->next = 0;
+	t->prev = q->tail;
+	if(q->tail) q->tail->next = t;
+	else q->head = t;
+	q->tail = t;
+}
+
+static inline void _qRemove(_MyQueue *q, _MyThread *t)
+{
+	if(t->prev) t->prev->next = t->next;
+	else q->head = t->next;
+	if(t->next) t->next->prev = t->prev;
+	else q->tail = t->prev;
+	t->next = t->prev = 0;
+}
+
+static inline _MyThread *_qPopFront(_MyQueue *q)
+{
+	_MyThread *t = q->head;
+	if(t) _qRemove(q, t);
+	return t;
+}
+
+static inline _MyThread *_qPopBack(_MyQueue *q)
+{
+	_MyThread *t = q->tail;
+	if(t) _qRemove(q, t);
+	return t;
+}
+
+typedef struct {
+	_MyLock lock;
+	int value;
+	_MyQueue block_queue;
+} _MySem;
+
+// hierarchical timing wheel, level l has slots of 2^(l*WHEEL_BITS) ticks
+struct _MyWheel {
+	_MyLock lock;
+	uint64_t clock; // next tick to process
+	int count; // armed timers
+	std::atomic<uint64_t> due{UINT64_MAX}; // tick at which something needs doing, for a lock-free check
+	uint64_t bitmap[WHEEL_LEVELS]; // non-empty slots
+	_MyTimer *slots[WHEEL_LEVELS][1 << WHEEL_BITS];
+};
+
+// a kernel thread running MyThreads
+typedef struct {
+	_MyContext sched_context; // the context outside mythread library on this kernel thread
+	_MyThread *current;
+	pthread_t tid;
+	unsigned int seed; // for picking steal victims
+
+	// one FIFO per level, level 0 runs first
+	// owner pops from the front, thieves steal from the back
+	_MyLock ready_lock;
+	_MyQueue ready_queue[MYTHREAD_PRIORITIES];
+	std::atomic<uint32_t> ready_levels{0}; // bitmap of the non-empty levels
+	std::atomic<int> nready{0};
+	std::atomic<_MyThread*> run_next{0}; // woken by a handoff, runs before the ready queue
+	int handoffs; // run_next threads run in a row, see _nextReady
+	uint64_t dispatched; // when current was switched to, if the policy charges run time
+
+	// free stacks by size class, see _stackAlloc
+	void *stack_cache[STACK_CLASSES];
+	int stack_cached[STACK_CLASSES];
+	void *alt_stack; // for reporting overflows into a guard page
+
+	// timers armed by threads running here, any worker may expire them
+	_MyWheel wheel;
+
+	// free control blocks, see _tcbAlloc
+	_MyThread *tcb_cache;
+	int tcb_cached;
+
+	// preemption ticks, see mythread_preempt.cc
+	timer_t preempt_timer;
+	bool preempt_armed;
+	unsigned int preempt_seen; // ticks at the last preemption tick
+
+	// work deferred until the context we switched away from has been saved
+	unsigned int ticks; // switches, for polling now and then while busy
+	int pass_left; // switches left in the current pass over the ready queue
+	_MyLock *post_unlock;
+	_MyThread *post_ready;
+	void *post_free_stack;
+	int post_free_class;
+	_MyThread *post_free; // control block
+
+	// the running coroutine has blocked, yielded or exited, see _runCoroutines
+	bool parked;
+	_MyThread *parked_next; // whom the switch away from it goes to
+
+#ifdef MYTHREAD_TRACE
+	std::atomic<_MyTraceRing*> trace{0}; // recent events on this worker, see mythread_trace.cc
+#endif
+} _MyWorker;
+
+extern _MyWorker *workers;
+extern int nworkers;
+
+// threads that are running or sitting in a ready queue
+extern std::atomic<int> nrunnable;
+
+// threads blocked on events that idle workers poll for, like fd readiness
+// or a timer
+extern std::atomic<int> npolled;
+
+// set while an idle worker sleeps in _ioPoll, until poll_deadline (ns, 0 = not yet known)
+extern std::atomic<bool> poll_blocked;
+extern std::atomic<uint64_t> poll_deadline;
+
+// The worker running the caller, 0 outside the library's kernel threads
+_MyWorker *_worker();
+
+// Raise the current thread's preempt_off, returns the thread (0 outside one)
+_MyThread *_preemptOff();
+
+// A thread more urgent than t is waiting in w's ready queue
+bool _urgentReady(_MyWorker *w, _MyThread *t);
+
+// ****** mythread_preempt.cc ******
+// preemption quantum in ns, 0 while the scheduler is cooperative
+extern uint64_t preempt_quantum;
+
+void _preemptInit();
+void _preemptFini();
+void _preemptStart(_MyWorker *w);
+void _preemptStop(_MyWorker *w);
+void _preemptIdle(_MyWorker *w, bool idle);
+
+// Give up the CPU for a preemption deferred while t had preemption disabled
+void _preemptPending(_MyThread *t);
+
+// Library entry points hold one of these, so the current thread is never
+// preempted with a lock held or halfway through a switch
+struct _MyNoPreempt {
+	_MyThread *thread;
+
+	_MyNoPreempt()
+	{
+		thread = preempt_quantum? _preemptOff() : 0;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+	}
+
+	~_MyNoPreempt()
+	{
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		if(thread && --thread->preempt_off == 0 && thread->preempt_pending) _preemptPending(thread);
+	}
+};
+
+// Make a blocked (or newly created) thread runnable
+void _wake(_MyThread *t);
+
+// Same, but t runs as soon as the current thread switches out, ahead of the
+// ready queue, while what the waker just handed it is still in the cache
+void _wakeNext(_MyThread *t);
+
+// Block the current thread, which must already be on some wait list guarded by held
+void _popNextThread(_MyLock *held);
+
+// ****** mythread_io.cc ******
+void _ioInit();
+void _ioFini();
+
+// Wait up to timeout_ns (-1 = forever) for fd events and wake the threads parked on them
+void _ioPoll(int64_t timeout_ns);
+
+// Interrupt a worker blocked in _ioPoll
+void _ioKick();
+
+// ****** mythread_uring.cc ******
+void _uringInit();
+
+// Signalled on io_uring completions, -1 without a ring
+int _uringEventFd();
+
+// Hand the queued requests of all threads to the kernel, false if it has not
+// taken them all
+bool _uringSubmit();
+
+// Wake the threads whose requests have completed
+void _uringReap();
+
+// ****** mythread_timer.cc ******
+// CLOCK_MONOTONIC in ns
+uint64_t _now();
+
+// Arm t's timer on the current worker's wheel. The caller then parks holding
+// t->wait_lock, with t->wait_state = WAIT_BLOCKED.
+void _timerArm(_MyThread *t, uint64_t deadline);
+
+// Back from a wait that may have armed a timer: true if it timed out
+bool _timerDone(_MyThread *t);
+
+// Called by a running thread that found t on a wait queue. True if it now owns
+// waking t, false if t has timed out and its timer wakes it instead.
+bool _waitClaim(_MyThread *t);
+
+// Expire the due timers of all workers
+void _timerRun();
+
+// Earliest deadline in ns on any wheel, UINT64_MAX if none
+uint64_t _timerDue();
+
+// ****** mythread_key.cc ******
+// Call the invoking thread's key destructors, on its way out
+void _keysExit();
+
+// ****** mythread_trace.cc ******
+// why a thread stopped running, see _traceSwitch
+enum { TRACE_YIELD = 1, TRACE_BLOCK, TRACE_EXIT };
+
+#ifdef MYTHREAD_TRACE
+// Give w its event ring, when it starts running threads
+void _traceStart(_MyWorker *w);
+
+// t has been created and is about to be queued
+void _traceCreate(_MyThread *t);
+
+// a blocked thread t is about to be queued
+void _traceWake(_MyThread *t);
+
+// w switches from prev to next (either may be 0 for the scheduler loop),
+// prev stops running for the reason why
+void _traceSwitch(_MyWorker *w, _MyThread *prev, _MyThread *next, int why);
+#endif
+
+#endif /* MYTHREAD_IMPL_H */
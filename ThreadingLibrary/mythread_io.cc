@@ -0,0 +1,331 @@
+#include "mythread_impl.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#define FD_CHUNK 1024 // fd table entries allocated at once
+#define FD_CHUNKS 1024 // so fds up to FD_CHUNK * FD_CHUNKS are handled
+#define IO_EVENTS 256 // events handled per epoll_wait
+#define SUBMIT_RETRY_NS 1000000 // how soon io_uring sqes the kernel turned away are retried
+
+enum { FD_UNKNOWN, FD_POLLED, FD_BLOCKING };
+
+// what we know about one file descriptor
+typedef struct {
+	_MyLock lock;
+	std::atomic<int> state; // FD_*, FD_BLOCKING if epoll refused it (e.g. a regular file)
+	bool rready; // an edge came in while nobody was waiting
+	bool wready;
+	_MyQueue readers;
+	_MyQueue writers;
+} _MyFd;
+
+static std::atomic<_MyFd*> fd_table[FD_CHUNKS];
+static int io_epfd = -1;
+static int io_wakefd = -1; // written to interrupt a worker sleeping in epoll_wait
+static std::atomic<bool> io_kicked{false};
+
+void _ioInit()
+{
+	io_epfd = epoll_create1(EPOLL_CLOEXEC);
+	io_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(io_epfd >= 0 && io_wakefd >= 0)
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = io_wakefd;
+		epoll_ctl(io_epfd, EPOLL_CTL_ADD, io_wakefd, &ev);
+
+		_uringInit();
+		if(_uringEventFd() >= 0)
+		{
+			ev.data.fd = _uringEventFd();
+			epoll_ctl(io_epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+		}
+	}
+}
+
+void _ioFini()
+{
+	if(io_epfd >= 0) close(io_epfd);
+	if(io_wakefd >= 0) close(io_wakefd);
+	io_epfd = io_wakefd = -1;
+}
+
+static _MyFd *_fdGet(int fd)
+{
+	if(fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) return 0;
+	std::atomic<_MyFd*> *slot = &fd_table[fd / FD_CHUNK];
+	_MyFd *chunk = slot->load(std::memory_order_acquire);
+	if(!chunk)
+	{
+		_MyFd *fresh = new _MyFd[FD_CHUNK]();
+		if(slot->compare_exchange_strong(chunk, fresh)) chunk = fresh;
+		else delete[] fresh;
+	}
+	return &chunk[fd % FD_CHUNK];
+}
+
+// The fd's entry, registered with epoll and made non-blocking on first use.
+// 0 if the caller is not a MyThread or the fd cannot be polled.
+static _MyFd *_fdPrepare(int fd)
+{
+	_MyWorker *w = _worker();
+	if(!w || !w->current || io_epfd < 0) return 0;
+	_MyFd *e = _fdGet(fd);
+	if(!e) return 0;
+
+	if(e->state == FD_UNKNOWN)
+	{
+		_lock(&e->lock);
+		if(e->state == FD_UNKNOWN)
+		{
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.fd = fd;
+			int flags = fcntl(fd, F_GETFL);
+			if(flags >= 0 && epoll_ctl(io_epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+			{
+				fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+				e->state = FD_POLLED;
+			}
+			else e->state = FD_BLOCKING;
+			e->rready = e->wready = false;
+		}
+		_unlock(&e->lock);
+	}
+	return e->state == FD_POLLED? e : 0;
+}
+
+// Park the current thread until an edge arrives for reading or writing.
+// Returns right away if one came in since the caller's last attempt.
+static void _fdWait(_MyFd *e, bool write)
+{
+	bool *ready = write? &e->wready : &e->rready;
+	_lock(&e->lock);
+	if(*ready)
+	{
+		*ready = false;
+		_unlock(&e->lock);
+		return;
+	}
+	_qPush(write? &e->writers : &e->readers, _worker()->current);
+	npolled.fetch_add(1);
+	_popNextThread(&e->lock);
+}
+
+// Wake everybody in q or, if nobody is waiting, remember the edge
+static void _fdReady(_MyQueue *q, bool *ready)
+{
+	if(!q->head)
+	{
+		*ready = true;
+		return;
+	}
+	_MyThread *t;
+	while((t = _qPopFront(q)))
+	{
+		_wake(t);
+		npolled.fetch_sub(1);
+	}
+}
+
+// epoll_wait with a timeout in ns, the next timer may be well under a millisecond away
+static int _epollWait(struct epoll_event *ev, int64_t timeout_ns)
+{
+#ifdef __NR_epoll_pwait2
+	static bool no_pwait2 = false;
+	if(timeout_ns > 0 && !no_pwait2)
+	{
+		struct timespec ts = { (time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000) };
+		int n = syscall(__NR_epoll_pwait2, io_epfd, ev, IO_EVENTS, &ts, 0, 0);
+		if(n >= 0 || errno != ENOSYS) return n;
+		no_pwait2 = true;
+	}
+#endif
+	// round up, waking early would only send us back to sleep
+	int64_t timeout_ms = timeout_ns < 0? -1 : (timeout_ns + 999999) / 1000000;
+	if(timeout_ms > INT_MAX) timeout_ms = INT_MAX;
+	return epoll_wait(io_epfd, ev, IO_EVENTS, timeout_ms);
+}
+
+/*
+ * Wait up to timeout_ns (-1 = forever) for fd events and wake the threads
+ * parked on them. Called by one idle worker at a time.
+ */
+void _ioPoll(int64_t timeout_ns)
+{
+	if(io_epfd < 0)
+	{ // nothing to wait on but timers
+		if(timeout_ns > 0)
+		{
+			struct timespec ts = { (time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000) };
+			nanosleep(&ts, 0);
+		}
+		return;
+	}
+	// before we possibly sleep on their completions
+	if(!_uringSubmit() && (timeout_ns < 0 || timeout_ns > SUBMIT_RETRY_NS)) timeout_ns = SUBMIT_RETRY_NS;
+
+	struct epoll_event ev[IO_EVENTS];
+	int n = _epollWait(ev, timeout_ns);
+	for(int i = 0; i < n; i++)
+	{
+		int fd = ev[i].data.fd;
+		if(fd == io_wakefd || fd == _uringEventFd())
+		{
+			uint64_t v;
+			if(read(fd, &v, sizeof(v)) < 0) {}
+			if(fd == io_wakefd) io_kicked.store(false);
+			continue;
+		}
+
+		_MyFd *e = _fdGet(fd);
+		uint32_t events = ev[i].events;
+		_lock(&e->lock);
+		if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) _fdReady(&e->readers, &e->rready);
+		if(events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) _fdReady(&e->writers, &e->wready);
+		_unlock(&e->lock);
+	}
+	_uringReap();
+}
+
+// Interrupt the worker blocked in _ioPoll, at most one write per poll
+void _ioKick()
+{
+	if(io_wakefd >= 0 && !io_kicked.exchange(true))
+	{
+		uint64_t one = 1;
+		if(write(io_wakefd, &one, sizeof(one)) < 0) {}
+	}
+}
+
+/*
+ * Same as read(2), but only the invoking MyThread waits for data;
+ * other threads keep running meanwhile.
+ */
+ssize_t MyThreadRead(int fd, void *buf, size_t count)
+{
+	_MyNoPreempt np;
+	_MyFd *e = _fdPrepare(fd);
+	while(true)
+	{
+		ssize_t n = read(fd, buf, count);
+		if(n >= 0 || !e || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+		_fdWait(e, false);
+	}
+}
+
+/*
+ * Same as write(2), but only the invoking MyThread waits for buffer space.
+ * Like write(2) it may write less than count bytes.
+ */
+ssize_t MyThreadWrite(int fd, const void *buf, size_t count)
+{
+	_MyNoPreempt np;
+	_MyFd *e = _fdPrepare(fd);
+	while(true)
+	{
+		ssize_t n = write(fd, buf, count);
+		if(n >= 0 || !e || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+		_fdWait(e, true);
+	}
+}
+
+/*
+ * Same as accept(2), but only the invoking MyThread waits for a connection.
+ */
+int MyThreadAccept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	_MyNoPreempt np;
+	_MyFd *e = _fdPrepare(sockfd);
+	while(true)
+	{
+		int fd = accept(sockfd, addr, addrlen);
+		if(fd >= 0)
+		{ // a recycled fd number, forget what we knew about the old one
+			_MyFd *ne = _fdGet(fd);
+			if(ne) ne->state = FD_UNKNOWN;
+			return fd;
+		}
+		if(!e || (errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+		_fdWait(e, false);
+	}
+}
+
+/*
+ * Same as connect(2), but only the invoking MyThread waits for the connection
+ * to be established.
+ */
+int MyThreadConnect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	_MyNoPreempt np;
+	_MyFd *e = _fdPrepare(sockfd);
+	if(e)
+	{ // only edges from here on say anything about the connection
+		_lock(&e->lock);
+		e->wready = false;
+		_unlock(&e->lock);
+	}
+
+	int res = connect(sockfd, addr, addrlen);
+	if(res == 0 || !e || errno != EINPROGRESS) return res;
+	while(true)
+	{
+		_fdWait(e, true);
+
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return -1;
+		if(err)
+		{
+			errno = err;
+			return -1;
+		}
+		struct sockaddr_storage peer;
+		len = sizeof(peer);
+		if(getpeername(sockfd, (struct sockaddr*)&peer, &len) == 0) return 0;
+		if(errno != ENOTCONN) return -1;
+		// a stale edge, still connecting
+	}
+}
+
+/*
+ * Waits until fd has become readable (events has MYTHREAD_FD_READ) or
+ * writable (MYTHREAD_FD_WRITE), for callers doing non-blocking I/O on it
+ * themselves. fd is made non-blocking on first use; with events = 0 that is
+ * all this does. Readiness is edge-triggered: only call this after the I/O
+ * has failed with EAGAIN, and expect to retry once woken.
+ * Returns 0 on success, -1 if fd cannot be polled (e.g. a regular file) or
+ * the caller is not a MyThread.
+ */
+int MyThreadWaitFd(int fd, int events)
+{
+	_MyNoPreempt np;
+	_MyFd *e = _fdPrepare(fd);
+	if(!e) return -1;
+	if(events & MYTHREAD_FD_READ) _fdWait(e, false);
+	else if(events & MYTHREAD_FD_WRITE) _fdWait(e, true);
+	return 0;
+}
+
+/*
+ * Close a fd that was used with the routines above. No thread may be waiting on it.
+ */
+int MyThreadClose(int fd)
+{
+	_MyNoPreempt np;
+	_MyFd *e = _fdGet(fd);
+	if(e)
+	{
+		_lock(&e->lock);
+		e->state = FD_UNKNOWN;
+		_unlock(&e->lock);
+	}
+	return close(fd);
+}
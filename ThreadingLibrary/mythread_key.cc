@@ -0,0 +1,116 @@
+#include "mythread_impl.h"
+#include <string.h>
+#include <limits.h>
+
+#define KEY_ROUNDS 4 // destructor passes at exit, for destructors that set values
+
+// Values live in a fixed array in the control block, indexed by the key's
+// slot, so a get is one load plus a check of the key it was set for. A key
+// is its slot plus a generation that changes whenever the slot is reused,
+// so values set for a deleted key never show through a new one. The array
+// is zeroed when a thread that set anything exits, so control blocks come
+// out of the pool clean and threads that never use keys pay nothing.
+
+typedef struct {
+	MyThreadKey key; // 0 while the slot is free
+	unsigned int generation;
+	void (*destructor)(void *);
+} _MyKey;
+
+static _MyKey keys[MYTHREAD_KEYS_MAX];
+static _MyLock keys_lock;
+
+/*
+ * Creates a key and stores it in *key. Every thread starts with the value 0
+ * for it. destructor, unless 0, is called with the value a thread still has
+ * for the key when it exits, unless that value is 0.
+ * Returns 0 on success, -1 if all MYTHREAD_KEYS_MAX keys are in use.
+ */
+int MyThreadKeyCreate(MyThreadKey *key, void (*destructor)(void *))
+{
+	_MyNoPreempt np;
+	_lock(&keys_lock);
+	for(int i = 0; i < MYTHREAD_KEYS_MAX; i++)
+	{
+		_MyKey *k = &keys[i];
+		if(k->key) continue;
+		if(++k->generation > UINT_MAX / MYTHREAD_KEYS_MAX) k->generation = 1; // key 0 stays invalid
+		k->key = k->generation * MYTHREAD_KEYS_MAX + i;
+		k->destructor = destructor;
+		*key = k->key;
+		_unlock(&keys_lock);
+		return 0;
+	}
+	_unlock(&keys_lock);
+	return -1;
+}
+
+/*
+ * Deletes key. Destructors are not called for the values threads have for it;
+ * freeing those is up to the caller.
+ * Returns 0 on success, -1 if key is not a key.
+ */
+int MyThreadKeyDelete(MyThreadKey key)
+{
+	_MyNoPreempt np;
+	_MyKey *k = &keys[key % MYTHREAD_KEYS_MAX];
+	_lock(&keys_lock);
+	bool valid = key && k->key == key;
+	if(valid) k->key = 0;
+	_unlock(&keys_lock);
+	return valid? 0 : -1;
+}
+
+/*
+ * Returns the invoking thread's value for key, 0 if it has not set one.
+ * key must not have been deleted.
+ */
+void *MyThreadGetSpecific(MyThreadKey key)
+{
+	_MyNoPreempt np;
+	_MyKeyValue *v = &_worker()->current->specific[key % MYTHREAD_KEYS_MAX];
+	return v->key == key? v->value : 0;
+}
+
+/*
+ * Sets the invoking thread's value for key.
+ * Returns 0 on success, -1 if key is not a key.
+ */
+int MyThreadSetSpecific(MyThreadKey key, const void *value)
+{
+	_MyNoPreempt np;
+	int slot = key % MYTHREAD_KEYS_MAX;
+	if(!key || keys[slot].key != key) return -1;
+	_MyThread *self = _worker()->current;
+	self->specific[slot].key = key;
+	self->specific[slot].value = (void*)value;
+	self->has_specific = true;
+	return 0;
+}
+
+void _keysExit()
+{
+	_MyThread *self;
+	{
+		_MyNoPreempt np;
+		self = _worker()->current;
+	}
+	if(!self->has_specific) return;
+
+	for(int round = 0; round < KEY_ROUNDS && self->has_specific; round++)
+	{
+		self->has_specific = false; // set again if a destructor sets a value
+		for(int i = 0; i < MYTHREAD_KEYS_MAX; i++)
+		{
+			_MyKeyValue *v = &self->specific[i];
+			void *value = v->value;
+			if(!value || v->key != keys[i].key) continue; // unset, or the key is gone
+			void (*destructor)(void *) = keys[i].destructor;
+			v->value = 0;
+			if(destructor) destructor(value);
+		}
+	}
+	// clean for the next thread to get the control block
+	memset(self->specific, 0, sizeof(self->specific));
+	self->has_specific = false;
+}
@@ -0,0 +1,234 @@
+#include "mythread_impl.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <link.h>
+#include <sys/auxv.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+
+#define PREEMPT_SIGNAL SIGALRM
+#define MAX_TEXT 8 // executable segments of the program we look at
+#define PREEMPT_RETRY 8 // retries per tick while the thread is outside the program
+
+// With a quantum set, every busy worker has a timer that sends it
+// PREEMPT_SIGNAL twice per quantum. A thread that has not switched since the
+// previous tick has run for a quantum and yields right from the signal
+// handler, on its own stack, so it resumes inside the handler. So does one
+// that a more urgent thread is waiting behind or that holds up due timers,
+// which bounds the dispatch latency of high priority threads to half a quantum.
+// That is only safe where the thread could have yielded itself: not in
+// library code or a MyThreadPreemptDisable section (preempt_off > 0, those
+// yield once preempt_off drops back to 0), and not in a shared library such
+// as libc, whose internal state is per kernel thread (then we try again
+// shortly, hoping to catch the thread back in the program). The vDSO keeps
+// no state, time calls in a loop must not make a thread unpreemptible.
+
+uint64_t preempt_quantum = 0;
+
+static struct sigaction old_preempt_action;
+
+// the program's own code and the vDSO, the only places a thread may be preempted
+static struct {
+	uintptr_t start;
+	uintptr_t end;
+} text[MAX_TEXT];
+static int ntext = 0;
+
+static int _findText(struct dl_phdr_info *info, size_t size, void *data)
+{
+	bool *first = (bool*)data;
+	uintptr_t vdso = getauxval(AT_SYSINFO_EHDR);
+	bool is_vdso = false;
+	for(int i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+		if(ph->p_type == PT_LOAD && vdso >= start && vdso < start + ph->p_memsz) is_vdso = true;
+	}
+	if(*first || is_vdso)
+	{ // the program comes first
+		for(int i = 0; i < info->dlpi_phnum && ntext < MAX_TEXT; i++)
+		{
+			const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+			if(ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) continue;
+			text[ntext].start = info->dlpi_addr + ph->p_vaddr;
+			text[ntext].end = text[ntext].start + ph->p_memsz;
+			ntext++;
+		}
+	}
+	*first = false;
+	return 0;
+}
+
+// where _preemptOff lives, set by the linker
+extern "C" char __start_mythread_nopreempt[], __stop_mythread_nopreempt[];
+
+static uintptr_t _pc(void *ucontext)
+{
+	ucontext_t *uc = (ucontext_t*)ucontext;
+#if defined(__x86_64__)
+	return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+	return uc->uc_mcontext.pc;
+#else
+	return 0;
+#endif
+}
+
+// Halfway through raising preempt_off, as good as having raised it
+static bool _inNoPreempt(void *ucontext)
+{
+	uintptr_t pc = _pc(ucontext);
+	return pc >= (uintptr_t)__start_mythread_nopreempt && pc < (uintptr_t)__stop_mythread_nopreempt;
+}
+
+static bool _inProgram(void *ucontext)
+{
+	uintptr_t pc = _pc(ucontext);
+	for(int i = 0; i < ntext; i++)
+	{
+		if(pc >= text[i].start && pc < text[i].end) return true;
+	}
+	return false;
+}
+
+// Next tick in first_ns, then every half quantum. 0 disarms.
+static void _preemptArm(_MyWorker *w, uint64_t first_ns)
+{
+	uint64_t tick = first_ns? preempt_quantum / 2 : 0;
+	struct itimerspec its;
+	its.it_interval.tv_sec = tick / 1000000000;
+	its.it_interval.tv_nsec = tick % 1000000000;
+	its.it_value.tv_sec = first_ns / 1000000000;
+	its.it_value.tv_nsec = first_ns % 1000000000;
+	timer_settime(w->preempt_timer, 0, &its, 0);
+}
+
+static void _preemptHandler(int sig, siginfo_t *info, void *ucontext)
+{
+	_MyWorker *w = _worker();
+	_MyThread *t = w? w->current : 0;
+	if(!t) return; // the scheduler itself
+
+	// a switch since the last tick, so t has not used up its quantum yet,
+	// unless a more urgent thread has been woken or a timer is due meanwhile
+	bool timers = npolled.load(std::memory_order_relaxed) > 0 && _timerDue() <= _now();
+	if(w->preempt_seen != w->ticks && !timers && !_urgentReady(w, t))
+	{
+		w->preempt_seen = w->ticks;
+		return;
+	}
+	if(t->preempt_off > 0 || _inNoPreempt(ucontext))
+	{
+		t->preempt_pending = true;
+		return;
+	}
+	if(!_inProgram(ucontext))
+	{
+		_preemptArm(w, preempt_quantum / 2 / PREEMPT_RETRY);
+		return;
+	}
+
+	int saved_errno = errno;
+	t->preempt_off++;
+	// the threads we switch to must stay preemptible
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, PREEMPT_SIGNAL);
+	pthread_sigmask(SIG_UNBLOCK, &set, 0);
+	if(timers) _timerRun(); // t is outside the library, as good as a call from t
+	MyThreadYield();
+
+	// We may be back on another kernel thread. Returning from the handler
+	// restores the signal stack saved in ucontext, which has to be this one's.
+	sigaltstack(0, &((ucontext_t*)ucontext)->uc_stack);
+	t->preempt_off--;
+	errno = saved_errno;
+}
+
+void _preemptInit()
+{
+	if(!preempt_quantum) return;
+	bool first = true;
+	dl_iterate_phdr(_findText, &first);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = _preemptHandler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART; // on the thread's stack, not the alternate one
+	sigemptyset(&sa.sa_mask);
+	sigaction(PREEMPT_SIGNAL, &sa, &old_preempt_action);
+}
+
+void _preemptFini()
+{
+	if(preempt_quantum) sigaction(PREEMPT_SIGNAL, &old_preempt_action, 0);
+}
+
+// Arm the calling worker's tick
+void _preemptStart(_MyWorker *w)
+{
+	if(!preempt_quantum) return;
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = PREEMPT_SIGNAL;
+	sev._sigev_un._tid = syscall(SYS_gettid);
+	// not the thread's CPU clock, which the kernel only looks at every scheduler tick
+	if(timer_create(CLOCK_MONOTONIC, &sev, &w->preempt_timer) != 0) return;
+	w->preempt_armed = true;
+	_preemptArm(w, preempt_quantum / 2);
+}
+
+// No ticks while the worker sleeps for lack of threads to run
+void _preemptIdle(_MyWorker *w, bool idle)
+{
+	if(w->preempt_armed) _preemptArm(w, idle? 0 : preempt_quantum / 2);
+}
+
+void _preemptStop(_MyWorker *w)
+{
+	if(w->preempt_armed) timer_delete(w->preempt_timer);
+	w->preempt_armed = false;
+}
+
+void _preemptPending(_MyThread *t)
+{
+	t->preempt_pending = false;
+	MyThreadYield();
+}
+
+/*
+ * Make the scheduler preemptive: a thread that runs for quantum_ns without
+ * switching is made to yield. Call before MyThreadInit. 0 (the default)
+ * keeps the scheduler cooperative.
+ */
+void MyThreadSetQuantum(unsigned long long quantum_ns)
+{
+	if(!workers) preempt_quantum = quantum_ns;
+}
+
+/*
+ * Keep the invoking thread from being preempted until the matching
+ * MyThreadPreemptEnable. Sections nest.
+ */
+void MyThreadPreemptDisable(void)
+{
+	_preemptOff();
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+/*
+ * End a MyThreadPreemptDisable section. If the quantum ran out meanwhile,
+ * the invoking thread yields now.
+ */
+void MyThreadPreemptEnable(void)
+{
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+	_MyWorker *w = _worker();
+	_MyThread *t = w? w->current : 0;
+	if(t && t->preempt_off > 0 && --t->preempt_off == 0 && t->preempt_pending) _preemptPending(t);
+}
@@ -0,0 +1,403 @@
+#include "mythread_impl.h"
+#include <string.h>
+
+// Mutexes, condition variables, rwlocks and barriers in the caller's memory.
+// Each has an atomic state word that the uncontended paths settle with one
+// atomic instruction, and a guard lock plus intrusive wait queues for the
+// rest. Ownership is handed straight to the thread that is woken, so
+// nobody wakes up just to find the lock taken again, and a condition
+// variable moves its waiters onto the mutex queue instead of waking them.
+// Only the slow paths enter the scheduler, so only they hold off preemption.
+
+enum { MUTEX_FREE, MUTEX_LOCKED, MUTEX_CONTENDED };
+
+typedef struct {
+	std::atomic<int> state; // MUTEX_*, MUTEX_CONTENDED while there may be waiters
+	_MyLock guard;
+	_MyQueue waiters;
+} _MyMutex;
+
+typedef struct {
+	_MyLock guard;
+	_MyQueue waiters;
+	_MyMutex *mutex; // the waiters' mutex, they are moved to its queue when signalled
+} _MyCond;
+
+#define RW_WRITER (1 << 30)
+#define RW_WAITERS (1 << 29) // keeps new readers out so writers do not starve
+#define RW_READERS (RW_WAITERS - 1)
+
+typedef struct {
+	std::atomic<int> state; // readers holding the lock, or RW_WRITER, plus RW_WAITERS
+	_MyLock guard;
+	_MyQueue readers;
+	_MyQueue writers;
+} _MyRWLock;
+
+typedef struct {
+	_MyLock guard;
+	int count;
+	int arrived;
+	_MyQueue waiters;
+} _MyBarrier;
+
+static_assert(sizeof(_MyMutex) <= sizeof(MyMutex), "MyMutex too small");
+static_assert(sizeof(_MyCond) <= sizeof(MyCond), "MyCond too small");
+static_assert(sizeof(_MyRWLock) <= sizeof(MyRWLock), "MyRWLock too small");
+static_assert(sizeof(_MyBarrier) <= sizeof(MyBarrier), "MyBarrier too small");
+
+// Park the current thread on q, releasing guard once it is switched out
+static void _park(_MyQueue *q, _MyLock *guard)
+{
+	_qPush(q, _worker()->current);
+	_popNextThread(guard);
+}
+
+// ****** MUTEX ******
+
+static void _mutexWait(_MyMutex *m)
+{
+	_MyNoPreempt np;
+	_lock(&m->guard);
+	if(m->state.exchange(MUTEX_CONTENDED, std::memory_order_acquire) == MUTEX_FREE)
+	{ // released meanwhile, we own it (possibly marked contended for nothing)
+		_unlock(&m->guard);
+		return;
+	}
+	_park(&m->waiters, &m->guard); // the unlocker hands the mutex to us
+}
+
+static void _mutexWake(_MyMutex *m)
+{
+	_MyNoPreempt np;
+	_lock(&m->guard);
+	_MyThread *t = _qPopFront(&m->waiters);
+	if(t)
+	{ // t owns the mutex now, it stays locked
+		m->state.store(m->waiters.head? MUTEX_CONTENDED : MUTEX_LOCKED, std::memory_order_relaxed);
+		_wake(t);
+	}
+	else m->state.store(MUTEX_FREE, std::memory_order_release);
+	_unlock(&m->guard);
+}
+
+// Give t the mutex or queue it for it, m->guard held
+static void _mutexTransfer(_MyMutex *m, _MyThread *t)
+{
+	int s = m->state.load(std::memory_order_relaxed);
+	while(true)
+	{
+		if(s == MUTEX_FREE)
+		{
+			if(!m->state.compare_exchange_weak(s, MUTEX_LOCKED, std::memory_order_acquire)) continue;
+			_wake(t);
+			return;
+		}
+		if(s == MUTEX_LOCKED && !m->state.compare_exchange_weak(s, MUTEX_CONTENDED)) continue;
+		_qPush(&m->waiters, t);
+		return;
+	}
+}
+
+/*
+ * Initialize a mutex. Same as zero-filling it or MYTHREAD_MUTEX_INITIALIZER.
+ */
+int MyMutexInit(MyMutex *mutex)
+{
+	if(!mutex) return -1;
+	memset(mutex, 0, sizeof(*mutex));
+	return 0;
+}
+
+/*
+ * Lock mutex, blocking the invoking thread while another one holds it.
+ * Waiting threads get the mutex in FIFO order.
+ */
+void MyMutexLock(MyMutex *mutex)
+{
+	_MyMutex *m = (_MyMutex*)mutex;
+	int expected = MUTEX_FREE;
+	if(!m->state.compare_exchange_strong(expected, MUTEX_LOCKED, std::memory_order_acquire)) _mutexWait(m);
+}
+
+/*
+ * Lock mutex if that needs no waiting. Returns 0 if it was locked, -1 otherwise.
+ */
+int MyMutexTryLock(MyMutex *mutex)
+{
+	_MyMutex *m = (_MyMutex*)mutex;
+	int expected = MUTEX_FREE;
+	return m->state.compare_exchange_strong(expected, MUTEX_LOCKED, std::memory_order_acquire)? 0 : -1;
+}
+
+/*
+ * Unlock mutex, which the invoking thread must hold. The first waiter, if
+ * any, gets the mutex; the invoking thread is not pre-empted.
+ */
+void MyMutexUnlock(MyMutex *mutex)
+{
+	_MyMutex *m = (_MyMutex*)mutex;
+	int expected = MUTEX_LOCKED;
+	if(!m->state.compare_exchange_strong(expected, MUTEX_FREE, std::memory_order_release)) _mutexWake(m);
+}
+
+/*
+ * Destroy mutex. Returns -1 if it is locked, 0 on success.
+ */
+int MyMutexDestroy(MyMutex *mutex)
+{
+	_MyNoPreempt np;
+	_MyMutex *m = (_MyMutex*)mutex;
+	if(!m) return -1;
+	_lock(&m->guard); // waits for an unlocker that has handed it on to be done with it
+	bool busy = m->state.load() != MUTEX_FREE;
+	_unlock(&m->guard);
+	return busy? -1 : 0;
+}
+
+// ****** CONDITION VARIABLE ******
+
+// Move up to n waiters onto the mutex, c->guard held
+static void _condWake(_MyCond *c, int n)
+{
+	if(!c->waiters.head) return;
+	_MyMutex *m = c->mutex;
+	_lock(&m->guard);
+	_MyThread *t;
+	while(n-- > 0 && (t = _qPopFront(&c->waiters))) _mutexTransfer(m, t);
+	_unlock(&m->guard);
+}
+
+/*
+ * Initialize a condition variable. Same as zero-filling it or MYTHREAD_COND_INITIALIZER.
+ */
+int MyCondInit(MyCond *cond)
+{
+	if(!cond) return -1;
+	memset(cond, 0, sizeof(*cond));
+	return 0;
+}
+
+/*
+ * Unlock mutex, which the invoking thread must hold, and block until cond is
+ * signalled. Returns with mutex locked again. All threads waiting on cond at
+ * the same time must use the same mutex. There are no spurious wakeups, but
+ * the condition may have changed again by the time the thread runs.
+ */
+void MyCondWait(MyCond *cond, MyMutex *mutex)
+{
+	_MyNoPreempt np;
+	_MyCond *c = (_MyCond*)cond;
+	_lock(&c->guard);
+	c->mutex = (_MyMutex*)mutex;
+	_qPush(&c->waiters, _worker()->current);
+	MyMutexUnlock(mutex);
+	_popNextThread(&c->guard); // back once the mutex has been handed to us
+}
+
+/*
+ * Wake one thread waiting on cond. It runs once it has the mutex.
+ */
+void MyCondSignal(MyCond *cond)
+{
+	_MyNoPreempt np;
+	_MyCond *c = (_MyCond*)cond;
+	_lock(&c->guard);
+	_condWake(c, 1);
+	_unlock(&c->guard);
+}
+
+/*
+ * Wake all threads waiting on cond. They are queued on the mutex and run
+ * one after another as it is passed on, rather than all at once.
+ */
+void MyCondBroadcast(MyCond *cond)
+{
+	_MyNoPreempt np;
+	_MyCond *c = (_MyCond*)cond;
+	_lock(&c->guard);
+	_condWake(c, INT32_MAX);
+	_unlock(&c->guard);
+}
+
+/*
+ * Destroy cond. Returns -1 if threads are waiting on it, 0 on success.
+ */
+int MyCondDestroy(MyCond *cond)
+{
+	_MyNoPreempt np;
+	_MyCond *c = (_MyCond*)cond;
+	if(!c) return -1;
+	_lock(&c->guard);
+	bool busy = c->waiters.head;
+	_unlock(&c->guard);
+	return busy? -1 : 0;
+}
+
+// ****** RWLOCK ******
+
+// The lock has been released with waiters around, pass it on, rw->guard held.
+// A releasing writer lets all waiting readers in, releasing readers let in a writer.
+static void _rwHandOff(_MyRWLock *rw, bool prefer_readers)
+{
+	if(rw->state.load(std::memory_order_relaxed) != RW_WAITERS) return; // taken again
+
+	_MyThread *t;
+	if(rw->writers.head && !(prefer_readers && rw->readers.head))
+	{
+		t = _qPopFront(&rw->writers);
+		rw->state.store(RW_WRITER | (rw->readers.head || rw->writers.head? RW_WAITERS : 0), std::memory_order_relaxed);
+		_wake(t);
+		return;
+	}
+
+	int n = 0;
+	for(t = rw->readers.head; t; t = t->next) n++;
+	rw->state.store(n | (rw->writers.head? RW_WAITERS : 0), std::memory_order_relaxed);
+	while((t = _qPopFront(&rw->readers))) _wake(t);
+}
+
+// Set RW_WAITERS and park on q unless the lock can be had after all, rw->guard held
+static void _rwWait(_MyRWLock *rw, bool write)
+{
+	int s = rw->state.load(std::memory_order_relaxed);
+	while(true)
+	{
+		bool available = write? s == 0 : !(s & (RW_WRITER | RW_WAITERS));
+		if(available)
+		{
+			if(!rw->state.compare_exchange_weak(s, write? RW_WRITER : s + 1, std::memory_order_acquire)) continue;
+			_unlock(&rw->guard);
+			return;
+		}
+		if(!(s & RW_WAITERS) && !rw->state.compare_exchange_weak(s, s | RW_WAITERS)) continue;
+		break;
+	}
+	// the last holder hands the lock to us
+	_park(write? &rw->writers : &rw->readers, &rw->guard);
+}
+
+/*
+ * Initialize a rwlock. Same as zero-filling it or MYTHREAD_RWLOCK_INITIALIZER.
+ */
+int MyRWLockInit(MyRWLock *rwlock)
+{
+	if(!rwlock) return -1;
+	memset(rwlock, 0, sizeof(*rwlock));
+	return 0;
+}
+
+/*
+ * Lock rwlock for reading. Any number of threads may hold it for reading at
+ * once, also while they yield or block. Once a writer waits, new readers
+ * queue behind it.
+ */
+void MyRWLockRdLock(MyRWLock *rwlock)
+{
+	_MyRWLock *rw = (_MyRWLock*)rwlock;
+	int s = rw->state.load(std::memory_order_relaxed);
+	if(!(s & (RW_WRITER | RW_WAITERS)) && rw->state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) return;
+
+	_MyNoPreempt np;
+	_lock(&rw->guard);
+	_rwWait(rw, false);
+}
+
+/*
+ * Lock rwlock for writing, excluding readers and other writers.
+ */
+void MyRWLockWrLock(MyRWLock *rwlock)
+{
+	_MyRWLock *rw = (_MyRWLock*)rwlock;
+	int expected = 0;
+	if(rw->state.compare_exchange_strong(expected, RW_WRITER, std::memory_order_acquire)) return;
+
+	_MyNoPreempt np;
+	_lock(&rw->guard);
+	_rwWait(rw, true);
+}
+
+/*
+ * Release a read or write lock on rwlock held by the invoking thread.
+ */
+void MyRWLockUnlock(MyRWLock *rwlock)
+{
+	_MyRWLock *rw = (_MyRWLock*)rwlock;
+	int s = rw->state.load(std::memory_order_relaxed);
+	bool writer = s & RW_WRITER;
+	if(writer)
+	{
+		if(s == RW_WRITER && rw->state.compare_exchange_strong(s, 0, std::memory_order_release)) return;
+		s = rw->state.fetch_and(~RW_WRITER, std::memory_order_release) & ~RW_WRITER;
+	}
+	else s = rw->state.fetch_sub(1, std::memory_order_release) - 1;
+	if(s != RW_WAITERS) return; // still held, or nobody waiting
+
+	_MyNoPreempt np;
+	_lock(&rw->guard);
+	_rwHandOff(rw, writer);
+	_unlock(&rw->guard);
+}
+
+/*
+ * Destroy rwlock. Returns -1 if it is held, 0 on success.
+ */
+int MyRWLockDestroy(MyRWLock *rwlock)
+{
+	_MyNoPreempt np;
+	_MyRWLock *rw = (_MyRWLock*)rwlock;
+	if(!rw) return -1;
+	_lock(&rw->guard); // waits for an unlocker that has handed it on to be done with it
+	bool busy = rw->state.load() != 0;
+	_unlock(&rw->guard);
+	return busy? -1 : 0;
+}
+
+// ****** BARRIER ******
+
+/*
+ * Initialize barrier to release count threads at a time. Returns -1 if count < 1.
+ */
+int MyBarrierInit(MyBarrier *barrier, int count)
+{
+	if(!barrier || count < 1) return -1;
+	memset(barrier, 0, sizeof(*barrier));
+	((_MyBarrier*)barrier)->count = count;
+	return 0;
+}
+
+/*
+ * Block until count threads are waiting on barrier, then release them all.
+ * Returns MYTHREAD_BARRIER_SERIAL in one of them (the last to arrive) and 0
+ * in the others. The barrier can be used again right away.
+ */
+int MyBarrierWait(MyBarrier *barrier)
+{
+	_MyNoPreempt np;
+	_MyBarrier *b = (_MyBarrier*)barrier;
+	_lock(&b->guard);
+	if(++b->arrived < b->count)
+	{
+		_park(&b->waiters, &b->guard);
+		return 0;
+	}
+	b->arrived = 0;
+	_MyThread *t;
+	while((t = _qPopFront(&b->waiters))) _wake(t);
+	_unlock(&b->guard);
+	return MYTHREAD_BARRIER_SERIAL;
+}
+
+/*
+ * Destroy barrier. Returns -1 if threads are waiting on it, 0 on success.
+ */
+int MyBarrierDestroy(MyBarrier *barrier)
+{
+	_MyNoPreempt np;
+	_MyBarrier *b = (_MyBarrier*)barrier;
+	if(!b) return -1;
+	_lock(&b->guard);
+	bool busy = b->arrived > 0;
+	_unlock(&b->guard);
+	return busy? -1 : 0;
+}
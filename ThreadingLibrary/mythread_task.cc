@@ -0,0 +1,358 @@
+#include "mythread_impl.h"
+
+// Futures, task groups and parallel loops, all on plain MyThreads. A future
+// is a thread whose start function returns a value; whoever waits for it
+// parks on the future until the thread has stored the value. A task group
+// keeps the futures it spawned and a list of the finished ones for
+// MyTaskGroupWaitAny.
+
+typedef struct _MyFuture _MyFuture;
+typedef struct _MyTaskGroup _MyTaskGroup;
+
+struct _MyFuture {
+	_MyLock lock;
+	bool done;
+	void *result;
+	_MyQueue waiters; // in MyFutureGet
+	void *(*funct)(void *);
+	void *args;
+
+	_MyTaskGroup *group; // 0 unless spawned by MyTaskGroupSpawn
+	_MyFuture *group_next; // all of the group's futures
+	_MyFuture *done_next; // finished and not yet returned by MyTaskGroupWaitAny
+};
+
+struct _MyTaskGroup {
+	_MyLock lock;
+	int pending; // spawned and not finished
+	_MyFuture *futures;
+	_MyFuture *done_head;
+	_MyFuture *done_tail;
+	_MyQueue all_waiters; // in MyTaskGroupWaitAll
+	_MyQueue any_waiters; // in MyTaskGroupWaitAny
+};
+
+// Park the current thread on q, releasing guard once it is switched out
+static void _park(_MyQueue *q, _MyLock *guard)
+{
+	_qPush(q, _worker()->current);
+	_popNextThread(guard);
+}
+
+static void _wakeAll(_MyQueue *q)
+{
+	_MyThread *t;
+	while((t = _qPopFront(q))) _wake(t);
+}
+
+// One of g's futures has finished or failed to start, g->lock held
+static void _groupDone(_MyTaskGroup *g)
+{
+	if(--g->pending == 0)
+	{ // WaitAny returns 0 to those who find nothing left
+		_wakeAll(&g->all_waiters);
+		_wakeAll(&g->any_waiters);
+	}
+	else if(g->done_head)
+	{
+		_MyThread *t = _qPopFront(&g->any_waiters);
+		if(t) _wake(t);
+	}
+}
+
+// ****** FUTURES ******
+
+static void _futureRun(void *arg)
+{
+	_MyFuture *f = (_MyFuture*)arg;
+	void *result = f->funct(f->args);
+	{
+		_MyNoPreempt np;
+		_MyTaskGroup *g = f->group;
+		if(g) _lock(&g->lock); // first, so WaitAny never finds a future still being finished
+		_lock(&f->lock);
+		f->result = result;
+		f->done = true;
+		_wakeAll(&f->waiters);
+		_unlock(&f->lock);
+		if(g)
+		{
+			if(g->done_tail) g->done_tail->done_next = f;
+			else g->done_head = f;
+			g->done_tail = f;
+			_groupDone(g);
+			_unlock(&g->lock); // g and f may be destroyed from here on
+		}
+	}
+	MyThreadExit();
+}
+
+static _MyFuture *_futureStart(void *(*funct)(void *), void *args, _MyTaskGroup *g)
+{
+	_MyFuture *f = new _MyFuture();
+	f->funct = funct;
+	f->args = args;
+	f->group = g;
+	if(g)
+	{ // in the group before it can finish
+		_lock(&g->lock);
+		g->pending++;
+		f->group_next = g->futures;
+		g->futures = f;
+		_unlock(&g->lock);
+	}
+	if(MyThreadCreate(_futureRun, f)) return f;
+
+	if(g)
+	{
+		_lock(&g->lock);
+		for(_MyFuture **p = &g->futures; *p; p = &(*p)->group_next)
+		{
+			if(*p != f) continue;
+			*p = f->group_next;
+			break;
+		}
+		_groupDone(g);
+		_unlock(&g->lock);
+	}
+	delete f;
+	return 0;
+}
+
+/*
+ * Starts funct(args) in a new thread, a child of the invoking one. Its return
+ * value is kept in the returned future until MyFutureDestroy.
+ * Returns 0 if the thread cannot be created.
+ */
+MyFuture MyFutureCreate(void *(*funct)(void *), void *args)
+{
+	return (MyFuture)_futureStart(funct, args, 0);
+}
+
+/*
+ * Waits until future's function has returned and returns its value.
+ * Any number of threads may get the value, any number of times.
+ */
+void *MyFutureGet(MyFuture future)
+{
+	_MyNoPreempt np;
+	_MyFuture *f = (_MyFuture*)future;
+	_lock(&f->lock);
+	if(!f->done) _park(&f->waiters, &f->lock); // woken once done is set
+	else _unlock(&f->lock);
+	return f->result;
+}
+
+/*
+ * Returns 1 if future's function has returned, 0 otherwise.
+ */
+int MyFutureReady(MyFuture future)
+{
+	_MyNoPreempt np;
+	_MyFuture *f = (_MyFuture*)future;
+	_lock(&f->lock);
+	bool done = f->done;
+	_unlock(&f->lock);
+	return done;
+}
+
+/*
+ * Destroys future. Returns -1 if its function has not returned yet or it
+ * belongs to a task group (those go with MyTaskGroupDestroy), 0 on success.
+ */
+int MyFutureDestroy(MyFuture future)
+{
+	_MyFuture *f = (_MyFuture*)future;
+	if(!f || f->group || !MyFutureReady(future)) return -1;
+	delete f;
+	return 0;
+}
+
+// ****** TASK GROUPS ******
+
+/*
+ * Creates an empty task group.
+ */
+MyTaskGroup MyTaskGroupCreate(void)
+{
+	return (MyTaskGroup)new _MyTaskGroup();
+}
+
+/*
+ * Same as MyFutureCreate, with the future added to group.
+ */
+MyFuture MyTaskGroupSpawn(MyTaskGroup group, void *(*funct)(void *), void *args)
+{
+	_MyNoPreempt np;
+	return (MyFuture)_futureStart(funct, args, (_MyTaskGroup*)group);
+}
+
+/*
+ * Waits until every future spawned in group so far has finished.
+ */
+void MyTaskGroupWaitAll(MyTaskGroup group)
+{
+	_MyNoPreempt np;
+	_MyTaskGroup *g = (_MyTaskGroup*)group;
+	_lock(&g->lock);
+	if(g->pending > 0) _park(&g->all_waiters, &g->lock);
+	else _unlock(&g->lock);
+}
+
+/*
+ * Returns a finished future of group that no MyTaskGroupWaitAny has returned
+ * yet, waiting for one to finish if need be. Futures come out in the order
+ * they finished. Returns 0 once all of them have been returned.
+ */
+MyFuture MyTaskGroupWaitAny(MyTaskGroup group)
+{
+	_MyNoPreempt np;
+	_MyTaskGroup *g = (_MyTaskGroup*)group;
+	_lock(&g->lock);
+	while(!g->done_head && g->pending > 0)
+	{
+		_park(&g->any_waiters, &g->lock);
+		_lock(&g->lock);
+	}
+	_MyFuture *f = g->done_head;
+	if(f)
+	{
+		g->done_head = f->done_next;
+		if(!g->done_head) g->done_tail = 0;
+		else
+		{ // more have finished, pass them on
+			_MyThread *t = _qPopFront(&g->any_waiters);
+			if(t) _wake(t);
+		}
+	}
+	_unlock(&g->lock);
+	return (MyFuture)f;
+}
+
+/*
+ * Destroys group and all the futures spawned in it.
+ * Returns -1 if some of them have not finished, 0 on success.
+ */
+int MyTaskGroupDestroy(MyTaskGroup group)
+{
+	_MyNoPreempt np;
+	_MyTaskGroup *g = (_MyTaskGroup*)group;
+	if(!g) return -1;
+	_lock(&g->lock);
+	bool busy = g->pending > 0 || g->all_waiters.head || g->any_waiters.head;
+	_unlock(&g->lock);
+	if(busy) return -1;
+	while(_MyFuture *f = g->futures)
+	{
+		g->futures = f->group_next;
+		delete f;
+	}
+	delete g;
+	return 0;
+}
+
+// ****** PARALLEL FOR ******
+
+// A loop shared by the invoking thread and its helpers. Chunks are claimed
+// from the front, each a share of what is left (guided scheduling), so they
+// start big and shrink towards grain as the range runs out and the workers
+// finish at about the same time.
+typedef struct {
+	std::atomic<long> next;
+	long end;
+	long grain;
+	long share; // a chunk is 1/share of the rest
+	void (*body)(long, long, void *);
+	void *args;
+
+	_MyLock lock;
+	int helpers; // still running
+	_MyThread *waiter; // the invoking thread, once it has run out of chunks
+} _MyLoop;
+
+static void _loopRun(_MyLoop *l)
+{
+	long start = l->next.load(std::memory_order_relaxed);
+	while(start < l->end)
+	{
+		long chunk = (l->end - start) / l->share;
+		if(chunk < l->grain) chunk = l->grain;
+		long stop = l->end - start > chunk? start + chunk : l->end;
+		if(l->next.compare_exchange_weak(start, stop, std::memory_order_relaxed))
+		{
+			l->body(start, stop, l->args);
+			start = l->next.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+static void _loopHelper(void *arg)
+{
+	_MyLoop *l = (_MyLoop*)arg;
+	_loopRun(l);
+	{
+		_MyNoPreempt np;
+		_lock(&l->lock);
+		if(--l->helpers == 0 && l->waiter) _wake(l->waiter);
+		_unlock(&l->lock); // the invoking thread takes the lock once more before l goes
+	}
+	MyThreadExit();
+}
+
+/*
+ * Calls body(chunk_begin, chunk_end, args) on consecutive chunks covering
+ * [begin, end), none of them shorter than grain except the last. With more
+ * than one worker the chunks are spread over helper threads, one per other
+ * worker; with one worker body gets the whole range in a single call.
+ * Returns once all chunks are done.
+ */
+void MyParallelFor(long begin, long end, long grain, void (*body)(long, long, void *), void *args)
+{
+	if(begin >= end) return;
+	if(grain < 1) grain = 1;
+	long chunks = (end - begin + grain - 1) / grain;
+	int helpers = nworkers - 1 < chunks - 1? nworkers - 1 : chunks - 1;
+	if(helpers <= 0)
+	{ // nobody to share with
+		body(begin, end, args);
+		return;
+	}
+
+	_MyLoop l;
+	l.next.store(begin, std::memory_order_relaxed);
+	l.end = end;
+	l.grain = grain;
+	l.share = 2 * (helpers + 1);
+	l.body = body;
+	l.args = args;
+	l.helpers = 0;
+	l.waiter = 0;
+	{
+		_MyNoPreempt np;
+		for(int i = 0; i < helpers; i++)
+		{
+			_lock(&l.lock);
+			l.helpers++;
+			_unlock(&l.lock);
+			if(!MyThreadCreate(_loopHelper, &l))
+			{ // do with fewer
+				_lock(&l.lock);
+				l.helpers--;
+				_unlock(&l.lock);
+				break;
+			}
+		}
+	}
+	_loopRun(&l); // preemptible, like the helpers' share
+
+	_MyNoPreempt np;
+	_lock(&l.lock);
+	if(l.helpers > 0)
+	{ // helpers still busy with their last chunks
+		l.waiter = _worker()->current;
+		_popNextThread(&l.lock);
+		// the helper that woke us may not have unlocked yet, l must outlive that
+		_lock(&l.lock);
+	}
+	_unlock(&l.lock);
+}
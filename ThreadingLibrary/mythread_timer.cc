@@ -0,0 +1,276 @@
+#include "mythread_impl.h"
+#include <time.h>
+
+#define TICK_SHIFT 16 // timers have a resolution of 2^16 ns, about 65 us
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+// Each worker has a hierarchical timing wheel for the timers armed on it.
+// A timer sits in the coarsest level whose slots still tell it apart from
+// the wheel's clock, and moves down a level ("cascades") when the clock
+// reaches its slot, so arming and cancelling are O(1) and expiring costs
+// O(1) per level a timer passes through. Any worker may expire a wheel's
+// timers; the scheduler checks them at the end of each pass over its ready
+// queue and the idle poller sleeps until the earliest one.
+
+uint64_t _now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _wheelAdd(_MyWheel *wh, _MyTimer *tm)
+{
+	uint64_t expires = tm->expires > wh->clock? tm->expires : wh->clock;
+	uint64_t delta = expires - wh->clock;
+	if(delta >> (WHEEL_LEVELS * WHEEL_BITS))
+	{ // beyond the top level, park it in the farthest slot and refile it from there
+		expires = wh->clock + ((uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+		delta = expires - wh->clock;
+	}
+	int level = 0;
+	while(level < WHEEL_LEVELS - 1 && delta >> ((level + 1) * WHEEL_BITS)) level++;
+	int slot = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+
+	_MyTimer **head = &wh->slots[level][slot];
+	tm->level = level;
+	tm->slot = slot;
+	tm->prev = 0;
+	tm->next = *head;
+	if(*head) (*head)->prev = tm;
+	*head = tm;
+	wh->bitmap[level] |= (uint64_t)1 << slot;
+}
+
+static void _wheelRemove(_MyWheel *wh, _MyTimer *tm)
+{
+	if(tm->prev) tm->prev->next = tm->next;
+	else wh->slots[tm->level][tm->slot] = tm->next;
+	if(tm->next) tm->next->prev = tm->prev;
+	if(!wh->slots[tm->level][tm->slot]) wh->bitmap[tm->level] &= ~((uint64_t)1 << tm->slot);
+}
+
+// Unlink a whole slot
+static _MyTimer *_wheelTake(_MyWheel *wh, int level, int slot)
+{
+	_MyTimer *tm = wh->slots[level][slot];
+	wh->slots[level][slot] = 0;
+	wh->bitmap[level] &= ~((uint64_t)1 << slot);
+	return tm;
+}
+
+// The clock is at a multiple of WHEEL_SIZE, refile the slots it has reached
+static void _wheelCascade(_MyWheel *wh)
+{
+	for(int level = 1; level < WHEEL_LEVELS; level++)
+	{
+		int slot = (wh->clock >> (level * WHEEL_BITS)) & WHEEL_MASK;
+		_MyTimer *tm = _wheelTake(wh, level, slot);
+		while(tm)
+		{
+			_MyTimer *next = tm->next;
+			_wheelAdd(wh, tm);
+			tm = next;
+		}
+		if(slot != 0) break;
+	}
+}
+
+// First tick at which the clock reaches a non-empty slot, on any level
+static uint64_t _wheelDue(_MyWheel *wh)
+{
+	if(wh->count == 0) return UINT64_MAX;
+	uint64_t due = UINT64_MAX;
+	for(int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		uint64_t bits = wh->bitmap[level];
+		if(!bits) continue;
+		int shift = level * WHEEL_BITS;
+		int cur = (wh->clock >> shift) & WHEEL_MASK;
+		uint64_t base = wh->clock >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+
+		// the current slot of an upper level has been cascaded already,
+		// anything in it and below it comes around in the next rotation
+		int first = level == 0? cur : cur + 1;
+		uint64_t ahead = first < WHEEL_SIZE? bits >> first << first : 0;
+		int slot;
+		if(ahead) slot = __builtin_ctzll(ahead);
+		else
+		{
+			slot = __builtin_ctzll(bits);
+			base += (uint64_t)1 << (shift + WHEEL_BITS);
+		}
+		uint64_t tick = base + ((uint64_t)slot << shift);
+		if(tick < due) due = tick;
+	}
+	return due;
+}
+
+// Advance the clock to now, moving the timers that expire onto *expired.
+// A timer whose thread has been claimed by a waker meanwhile is just dropped.
+static void _wheelAdvance(_MyWheel *wh, uint64_t now, _MyTimer **expired)
+{
+	uint64_t tick;
+	while((tick = _wheelDue(wh)) <= now)
+	{ // nothing happens between the clock and tick, jump right there
+		wh->clock = tick;
+		if((tick & WHEEL_MASK) == 0) _wheelCascade(wh);
+		_MyTimer *tm = _wheelTake(wh, 0, tick & WHEEL_MASK);
+		while(tm)
+		{
+			_MyTimer *next = tm->next;
+			tm->queued = false;
+			wh->count--;
+			int expected = WAIT_BLOCKED;
+			if(tm->thread->wait_state.compare_exchange_strong(expected, WAIT_TIMEDOUT))
+			{
+				tm->next = *expired;
+				*expired = tm;
+			}
+			tm = next;
+		}
+		wh->clock = tick + 1;
+	}
+	if(wh->clock <= now)
+	{ // nothing due up to now either
+		wh->clock = now + 1;
+		tick = _wheelDue(wh);
+	}
+	wh->due.store(tick);
+}
+
+// Wake the threads of expired timers
+static void _timerWake(_MyTimer *expired)
+{
+	while(expired)
+	{
+		_MyThread *t = expired->thread;
+		expired = expired->next;
+
+		// once we hold the lock it parked with, the thread has been switched out
+		_lock(t->wait_lock);
+		if(t->wait_queue)
+		{
+			_qRemove(t->wait_queue, t);
+			t->wait_queue = 0;
+		}
+		_unlock(t->wait_lock);
+		_wake(t);
+	}
+}
+
+void _timerArm(_MyThread *t, uint64_t deadline)
+{
+	_MyWheel *wh = &_worker()->wheel;
+	_MyTimer *tm = &t->timer;
+	tm->thread = t;
+	tm->expires = (deadline + ((uint64_t)1 << TICK_SHIFT) - 1) >> TICK_SHIFT; // never early
+
+	_lock(&wh->lock);
+	if(wh->count == 0)
+	{ // nobody advanced an empty wheel, catch up
+		uint64_t now = _now() >> TICK_SHIFT;
+		if(wh->clock < now) wh->clock = now;
+	}
+	_wheelAdd(wh, tm);
+	tm->wheel = wh;
+	tm->queued = true;
+	wh->count++;
+	uint64_t due = _wheelDue(wh);
+	wh->due.store(due);
+	_unlock(&wh->lock);
+	npolled.fetch_add(1);
+
+	// an idle worker sleeping past the new deadline has to recompute it
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(poll_blocked.load())
+	{
+		uint64_t until = poll_deadline.load();
+		if(until == 0 || (due << TICK_SHIFT) < until) _ioKick();
+	}
+}
+
+bool _timerDone(_MyThread *t)
+{
+	if(!t->timer.wheel) return false;
+	t->timer.wheel = 0;
+	npolled.fetch_sub(1);
+	return t->wait_state.load() == WAIT_TIMEDOUT;
+}
+
+bool _waitClaim(_MyThread *t)
+{
+	int expected = WAIT_BLOCKED;
+	if(!t->wait_state.compare_exchange_strong(expected, WAIT_SIGNALED)) return false;
+
+	_MyTimer *tm = &t->timer;
+	_MyWheel *wh = tm->wheel;
+	if(wh)
+	{ // cancel, the due tick may stay early, that only costs a look
+		_lock(&wh->lock);
+		if(tm->queued)
+		{
+			_wheelRemove(wh, tm);
+			tm->queued = false;
+			if(--wh->count == 0) wh->due.store(UINT64_MAX);
+		}
+		_unlock(&wh->lock);
+	}
+	return true;
+}
+
+void _timerRun()
+{
+	uint64_t now = _now() >> TICK_SHIFT;
+	for(int i = 0; i < nworkers; i++)
+	{
+		_MyWheel *wh = &workers[i].wheel;
+		if(wh->due.load(std::memory_order_relaxed) > now || !_trylock(&wh->lock)) continue;
+		_MyTimer *expired = 0;
+		_wheelAdvance(wh, now, &expired);
+		_unlock(&wh->lock);
+		_timerWake(expired);
+	}
+}
+
+uint64_t _timerDue()
+{
+	uint64_t due = UINT64_MAX;
+	for(int i = 0; i < nworkers; i++)
+	{
+		uint64_t d = workers[i].wheel.due.load();
+		if(d < due) due = d;
+	}
+	return due == UINT64_MAX? due : due << TICK_SHIFT;
+}
+
+/*
+ * Suspend the invoking thread for at least ns nanoseconds. Other threads keep
+ * running meanwhile. Outside of a MyThread this is a plain nanosleep.
+ */
+void MyThreadSleep(unsigned long long ns)
+{
+	_MyNoPreempt np;
+	_MyWorker *w = _worker();
+	if(!w || !w->current)
+	{
+		struct timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+		nanosleep(&ts, 0);
+		return;
+	}
+	if(ns == 0)
+	{
+		MyThreadYield();
+		return;
+	}
+
+	_MyThread *self = w->current;
+	_lock(&self->lock);
+	self->wait_lock = &self->lock;
+	self->wait_queue = 0;
+	self->wait_state.store(WAIT_BLOCKED);
+	_timerArm(self, _now() + ns);
+	_popNextThread(&self->lock);
+	if(!self->coroutine) _timerDone(self); // a coroutine has not slept yet, _runCoroutines does it
+}
@@ -0,0 +1,210 @@
+#include "mythread_impl.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Without TRACE=yes in the Makefile none of this is compiled, the hooks in
+// the scheduler expand to nothing and the public calls just return -1.
+#ifdef MYTHREAD_TRACE
+
+#define TRACE_EVENTS 65536 // per worker, older events are overwritten
+
+// Every switch charges the thread switched away from for its run and the one
+// switched to for its time in the ready queue; waking a thread charges it
+// for the time it was blocked. Each worker also records these as events in
+// a ring of its own, so recording takes no shared lock.
+
+enum { STATE_RUNNING, STATE_READY, STATE_BLOCKED };
+enum { EVENT_RUN, EVENT_WAKE, EVENT_CREATE };
+
+typedef struct {
+	uint64_t ts; // ns
+	uint64_t dur; // run events
+	uint64_t wait; // ready before a run, blocked before a wake
+	unsigned int thread;
+	unsigned int other; // TRACE_* for a run, the waker or creator otherwise
+	int type;
+} _MyTraceEvent;
+
+struct _MyTraceRing {
+	_MyLock lock; // only contended by MyThreadTraceDump
+	uint64_t count; // events ever recorded
+	_MyTraceEvent events[TRACE_EVENTS];
+};
+
+static std::atomic<unsigned int> next_id{1}; // 0 is nobody
+
+void _traceStart(_MyWorker *w)
+{
+	if(!w->trace.load()) w->trace.store(new _MyTraceRing());
+}
+
+static void _record(int type, uint64_t ts, uint64_t dur, uint64_t wait, unsigned int thread, unsigned int other)
+{
+	_MyWorker *w = _worker();
+	_MyTraceRing *ring = w? w->trace.load(std::memory_order_relaxed) : 0;
+	if(!ring) return;
+	_lock(&ring->lock);
+	_MyTraceEvent *e = &ring->events[ring->count++ % TRACE_EVENTS];
+	e->ts = ts;
+	e->dur = dur;
+	e->wait = wait;
+	e->thread = thread;
+	e->other = other;
+	e->type = type;
+	_unlock(&ring->lock);
+}
+
+static unsigned int _currentId()
+{
+	_MyWorker *w = _worker();
+	return w && w->current? w->current->id : 0;
+}
+
+void _traceCreate(_MyThread *t)
+{
+	t->id = next_id.fetch_add(1, std::memory_order_relaxed);
+	t->trace_state = STATE_READY;
+	t->trace_since = _now();
+	t->trace_waited = 0;
+	t->stats = MyThreadStats();
+	_record(EVENT_CREATE, t->trace_since, 0, 0, t->id, _currentId());
+}
+
+void _traceWake(_MyThread *t)
+{
+	if(t->trace_state != STATE_BLOCKED) return; // just created
+	uint64_t now = _now();
+	uint64_t blocked = now - t->trace_since;
+	t->stats.blocked_ns += blocked;
+	t->trace_state = STATE_READY;
+	t->trace_since = now;
+	_record(EVENT_WAKE, now, 0, blocked, t->id, _currentId());
+}
+
+void _traceSwitch(_MyWorker *w, _MyThread *prev, _MyThread *next, int why)
+{
+	uint64_t now = _now();
+	if(prev)
+	{
+		prev->stats.cpu_ns += now - prev->trace_since;
+		if(why == TRACE_YIELD) prev->stats.yields++;
+		_record(EVENT_RUN, prev->trace_since, now - prev->trace_since, prev->trace_waited, prev->id, why);
+		prev->trace_state = why == TRACE_YIELD? STATE_READY : STATE_BLOCKED;
+		prev->trace_since = now;
+	}
+	if(next)
+	{
+		next->trace_waited = now - next->trace_since;
+		next->stats.ready_ns += next->trace_waited;
+		next->stats.switches++;
+		next->trace_state = STATE_RUNNING;
+		next->trace_since = now;
+	}
+}
+
+#endif
+
+/*
+ * Copies the run time statistics of thread, or of the invoking thread if
+ * thread is 0, to *stats. thread must not have exited. The invoking thread's
+ * CPU time includes its current run.
+ * Returns 0 on success, -1 if the library was built without TRACE=yes.
+ */
+int MyThreadGetStats(MyThread thread, MyThreadStats *stats)
+{
+#ifdef MYTHREAD_TRACE
+	_MyNoPreempt np;
+	_MyWorker *w = _worker();
+	_MyThread *t = thread? (_MyThread*)thread : w? w->current : 0;
+	if(!t || !stats) return -1;
+	*stats = t->stats;
+	if(w && t == w->current) stats->cpu_ns += _now() - t->trace_since;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+#ifdef MYTHREAD_TRACE
+static const char *_why(unsigned int why)
+{
+	switch(why)
+	{
+		case TRACE_YIELD: return "yield";
+		case TRACE_BLOCK: return "block";
+		case TRACE_EXIT: return "exit";
+	}
+	return "?";
+}
+#endif
+
+/*
+ * Writes the events still in the workers' rings to path in the Chrome
+ * trace-event format, for chrome://tracing or Perfetto. Each worker is a
+ * track of run slices named after the thread, with why the run ended and how
+ * long the thread had been ready before it. Wakes and creations are instants.
+ * May be called from a thread or after MyThreadInit has returned.
+ * Returns 0 on success, -1 if path cannot be written or the library was built
+ * without TRACE=yes.
+ */
+int MyThreadTraceDump(const char *path)
+{
+#ifdef MYTHREAD_TRACE
+	_MyNoPreempt np;
+	FILE *f = fopen(path, "w");
+	if(!f) return -1;
+	_MyTraceEvent *copy = (_MyTraceEvent*)malloc(sizeof(_MyTraceEvent) * TRACE_EVENTS);
+	if(!copy)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"mythread\"}}");
+	uint64_t base = UINT64_MAX; // timestamps start at the first event still around
+	for(int pass = 0; pass < 2; pass++)
+	{
+		for(int i = 0; i < nworkers; i++)
+		{
+			_MyTraceRing *ring = workers[i].trace.load();
+			if(!ring) continue;
+			_lock(&ring->lock);
+			uint64_t first = ring->count > TRACE_EVENTS? ring->count - TRACE_EVENTS : 0;
+			int n = ring->count - first;
+			for(int k = 0; k < n; k++) copy[k] = ring->events[(first + k) % TRACE_EVENTS];
+			_unlock(&ring->lock);
+
+			if(pass == 0)
+			{
+				if(n && copy[0].ts < base) base = copy[0].ts;
+				continue;
+			}
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", i, i);
+			for(int k = 0; k < n; k++)
+			{
+				_MyTraceEvent *e = &copy[k];
+				double ts = (e->ts > base? e->ts - base : 0) / 1000.0;
+				if(e->type == EVENT_RUN)
+					fprintf(f, ",\n{\"name\":\"thread %u\",\"cat\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+						"\"args\":{\"thread\":%u,\"end\":\"%s\",\"ready_us\":%.3f}}",
+						e->thread, i, ts, e->dur / 1000.0, e->thread, _why(e->other), e->wait / 1000.0);
+				else if(e->type == EVENT_WAKE)
+					fprintf(f, ",\n{\"name\":\"wake\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+						"\"args\":{\"thread\":%u,\"by\":%u,\"blocked_us\":%.3f}}",
+						i, ts, e->thread, e->other, e->wait / 1000.0);
+				else
+					fprintf(f, ",\n{\"name\":\"create\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+						"\"args\":{\"thread\":%u,\"parent\":%u}}",
+						i, ts, e->thread, e->other);
+			}
+		}
+	}
+	fprintf(f, "\n]}\n");
+	free(copy);
+	return fclose(f) == 0? 0 : -1;
+#else
+	(void)path;
+	return -1;
+#endif
+}
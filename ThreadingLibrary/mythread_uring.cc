@@ -0,0 +1,231 @@
+#include "mythread_impl.h"
+#include <unistd.h>
+#include <errno.h>
+
+// Without IO_URING in the Makefile (or if the kernel refuses to set up a
+// ring) MyThreadPread/Pwrite/Fsync are plain blocking calls.
+#ifdef MYTHREAD_IO_URING
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+
+// lives on the waiting thread's stack, its address is the sqe's user_data
+typedef struct {
+	_MyThread *thread;
+	int res;
+} _MyUringReq;
+
+// One ring shared by all workers. Threads only queue sqes; they are handed to
+// the kernel in one io_uring_enter per scheduler pass (see _uringSubmit).
+static struct {
+	int fd;
+	int eventfd; // signalled on completions, watched by the epoll poller
+	unsigned entries;
+
+	std::atomic<unsigned> *sq_head;
+	std::atomic<unsigned> *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	std::atomic<unsigned> *cq_head;
+	std::atomic<unsigned> *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// guards the sq tail and the cq head; a waiter holds it until it is
+	// switched out, so a completion can never wake a thread still running
+	_MyLock lock;
+	std::atomic<bool> unsubmitted;
+	unsigned inflight; // queued and not reaped, kept below the cq size
+} ring = { -1, -1 };
+
+void _uringInit()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(fd < 0) return;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = sq_size > cq_size? sq_size : cq_size;
+	char *sq = (char*)mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	char *cq = sq;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
+	{
+		cq = (char*)mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	void *sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || efd < 0
+		|| syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+	{ // no ring then, the mappings go away with the process
+		if(efd >= 0) close(efd);
+		close(fd);
+		return;
+	}
+
+	ring.entries = p.sq_entries < p.cq_entries? p.sq_entries : p.cq_entries;
+	ring.sq_head = (std::atomic<unsigned>*)(sq + p.sq_off.head);
+	ring.sq_tail = (std::atomic<unsigned>*)(sq + p.sq_off.tail);
+	ring.sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+	ring.sqes = (struct io_uring_sqe*)sqes;
+	ring.cq_head = (std::atomic<unsigned>*)(cq + p.cq_off.head);
+	ring.cq_tail = (std::atomic<unsigned>*)(cq + p.cq_off.tail);
+	ring.cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	ring.eventfd = efd;
+	ring.fd = fd;
+}
+
+int _uringEventFd()
+{
+	return ring.eventfd;
+}
+
+// Hand all queued sqes to the kernel
+bool _uringSubmit()
+{
+	if(ring.fd < 0 || !ring.unsubmitted.load(std::memory_order_relaxed) || !ring.unsubmitted.exchange(false)) return true;
+	unsigned tail = ring.sq_tail->load(std::memory_order_acquire);
+	while(true)
+	{
+		// the kernel moves the sq head past the sqes it has taken
+		unsigned n = tail - ring.sq_head->load(std::memory_order_acquire);
+		if(n == 0) return true;
+		int res = syscall(__NR_io_uring_enter, ring.fd, n, 0, 0, 0, 0);
+		if(res < 0 && errno == EINTR) continue;
+		if(res < 0 || (unsigned)res < n) break;
+	}
+	// short of memory or the cq is full (EAGAIN/EBUSY), the next pass retries
+	ring.unsubmitted.store(true);
+	return false;
+}
+
+// Wake the threads whose requests have completed
+void _uringReap()
+{
+	if(ring.fd < 0) return;
+	if(ring.cq_head->load(std::memory_order_relaxed) == ring.cq_tail->load(std::memory_order_acquire)) return;
+
+	_lock(&ring.lock);
+	unsigned head = ring.cq_head->load(std::memory_order_relaxed);
+	unsigned tail = ring.cq_tail->load(std::memory_order_acquire);
+	for(; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+		_MyUringReq *req = (_MyUringReq*)(uintptr_t)cqe->user_data;
+		req->res = cqe->res;
+		_wake(req->thread);
+		npolled.fetch_sub(1);
+		ring.inflight--;
+	}
+	ring.cq_head->store(head, std::memory_order_release);
+	_unlock(&ring.lock);
+}
+
+// Queue a request and park the current thread until it completes.
+// Returns the cqe result, -errno on failure.
+static int _uringDo(int op, int fd, const void *buf, size_t count, off_t offset)
+{
+	_MyUringReq req;
+	req.thread = _worker()->current;
+	while(true)
+	{
+		_lock(&ring.lock);
+		unsigned tail = ring.sq_tail->load(std::memory_order_relaxed);
+		if(tail - ring.sq_head->load(std::memory_order_acquire) < ring.entries && ring.inflight < ring.entries) break;
+		// ring full, push what is queued and let the completions drain
+		_unlock(&ring.lock);
+		ring.unsubmitted.store(true);
+		_uringSubmit();
+		_uringReap();
+		MyThreadYield();
+	}
+
+	unsigned tail = ring.sq_tail->load(std::memory_order_relaxed);
+	unsigned idx = tail & ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = count;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)&req;
+	ring.sq_array[idx] = idx;
+	ring.sq_tail->store(tail + 1, std::memory_order_release);
+	ring.inflight++;
+	ring.unsubmitted.store(true);
+
+	npolled.fetch_add(1);
+	_popNextThread(&ring.lock);
+	return req.res;
+}
+
+static bool _uringUsable()
+{
+	_MyWorker *w = _worker();
+	return ring.fd >= 0 && w && w->current;
+}
+
+static ssize_t _uringResult(int res)
+{
+	if(res >= 0) return res;
+	errno = -res;
+	return -1;
+}
+
+#else
+
+void _uringInit() {}
+int _uringEventFd() { return -1; }
+bool _uringSubmit() { return true; }
+void _uringReap() {}
+
+#endif
+
+/*
+ * Same as pread(2). With io_uring only the invoking MyThread waits;
+ * requests from all threads are submitted together once per scheduler pass.
+ */
+ssize_t MyThreadPread(int fd, void *buf, size_t count, off_t offset)
+{
+	_MyNoPreempt np;
+#ifdef MYTHREAD_IO_URING
+	if(_uringUsable()) return _uringResult(_uringDo(IORING_OP_READ, fd, buf, count, offset));
+#endif
+	return pread(fd, buf, count, offset);
+}
+
+/*
+ * Same as pwrite(2), only the invoking MyThread waits.
+ */
+ssize_t MyThreadPwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	_MyNoPreempt np;
+#ifdef MYTHREAD_IO_URING
+	if(_uringUsable()) return _uringResult(_uringDo(IORING_OP_WRITE, fd, buf, count, offset));
+#endif
+	return pwrite(fd, buf, count, offset);
+}
+
+/*
+ * Same as fsync(2), only the invoking MyThread waits.
+ */
+int MyThreadFsync(int fd)
+{
+	_MyNoPreempt np;
+#ifdef MYTHREAD_IO_URING
+	if(_uringUsable()) return _uringResult(_uringDo(IORING_OP_FSYNC, fd, 0, 0, 0));
+#endif
+	return fsync(fd);
+}